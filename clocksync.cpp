@@ -0,0 +1,114 @@
+#include "clocksync.h"
+#include <chrono>
+
+long long ClockSync::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ClockSync::fit()
+{
+    std::size_t n = samples.size();
+    if (n < 2) {
+        return;
+    }
+    /* least squares relative to the oldest sample keeps the sums small */
+    double x0 = samples.front().first;
+    long long y0 = samples.front().second;
+    double meanX = 0;
+    double meanY = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        meanX += samples[i].first - x0;
+        meanY += double(samples[i].second - y0);
+    }
+    meanX /= n;
+    meanY /= n;
+    double sxx = 0;
+    double sxy = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        double dx = samples[i].first - x0 - meanX;
+        double dy = double(samples[i].second - y0) - meanY;
+        sxx += dx*dx;
+        sxy += dx*dy;
+    }
+    if (sxx <= 0) {
+        return;
+    }
+    slope = sxy/sxx;
+    /* transport delay only ever adds, so the line goes through the lower
+       envelope instead of the mean */
+    double lowest = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        double residual = double(samples[i].second - y0) - slope*(samples[i].first - x0);
+        if (i == 0 || residual < lowest) {
+            lowest = residual;
+        }
+    }
+    intercept = double(y0) + lowest - slope*x0;
+    return;
+}
+
+ClockSync::ClockSync(std::size_t window_):
+    window(window_ < 2 ? 2 : window_),
+    slope(0),
+    intercept(0)
+{
+
+}
+
+void ClockSync::update(double deviceTime, long long hostTime)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    /* a device counter that went backwards was reset or wrapped */
+    if (!samples.empty() && deviceTime < samples.back().first) {
+        samples.clear();
+        slope = 0;
+    }
+    samples.push_back(std::make_pair(deviceTime, hostTime));
+    if (samples.size() > window) {
+        samples.pop_front();
+    }
+    fit();
+    return;
+}
+
+long long ClockSync::toHost(double deviceTime) const
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if (slope == 0) {
+        return samples.empty() ? 0 : samples.back().second;
+    }
+    return (long long)(intercept + slope*deviceTime);
+}
+
+bool ClockSync::isReady() const
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return slope != 0;
+}
+
+double ClockSync::rate() const
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return slope;
+}
+
+double ClockSync::drift(double nominalRate) const
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if (slope == 0 || nominalRate == 0) {
+        return 0;
+    }
+    /* a fast device clock covers a host ns in fewer ticks than nominal */
+    return (nominalRate/slope - 1.0)*1e6;
+}
+
+void ClockSync::reset()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    samples.clear();
+    slope = 0;
+    intercept = 0;
+    return;
+}
@@ -0,0 +1,38 @@
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/* maps a device clock (a counter carried in the payload, a frame number)
+   onto the host steady clock from (device time, completion time) pairs,
+   one instance per device so streams of several devices can be aligned */
+class ClockSync
+{
+public:
+    constexpr static std::size_t default_window = 256;
+    /* steady clock in nanoseconds, the clock of every completion timestamp */
+    static long long now();
+protected:
+    std::size_t window;
+    std::deque<std::pair<double, long long> > samples;
+    mutable std::mutex mutex;
+    /* host ns per device tick, and host time of device time 0 */
+    double slope;
+    double intercept;
+protected:
+    void fit();
+public:
+    explicit ClockSync(std::size_t window_ = default_window);
+    /* every few packets is enough, the fit is redone over the window */
+    void update(double deviceTime, long long hostTime);
+    /* host nanoseconds of a device time, hostTime of the last sample before the fit is ready */
+    long long toHost(double deviceTime) const;
+    bool isReady() const;
+    double rate() const;
+    /* parts per million the device runs fast (+) or slow (-) against its nominal tick */
+    double drift(double nominalRate) const;
+    void reset();
+};
+
+#endif // CLOCKSYNC_H
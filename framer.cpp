@@ -0,0 +1,362 @@
+#include "framer.h"
+#include <cstring>
+
+namespace {
+
+struct Crc32Table
+{
+    std::uint32_t table[8][256];
+    Crc32Table()
+    {
+        for (std::uint32_t i = 0; i < 256; i++) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[0][i] = c;
+        }
+        /* slicing by 8: table[s] advances a byte s positions further */
+        for (std::uint32_t i = 0; i < 256; i++) {
+            for (int s = 1; s < 8; s++) {
+                table[s][i] = (table[s - 1][i] >> 8) ^ table[0][table[s - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+struct Crc16Table
+{
+    std::uint16_t table[256];
+    Crc16Table()
+    {
+        for (std::uint32_t i = 0; i < 256; i++) {
+            std::uint32_t c = i << 8;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+            }
+            table[i] = c & 0xffff;
+        }
+    }
+};
+
+std::uint32_t readLE(const unsigned char *data, std::size_t size)
+{
+    std::uint32_t value = 0;
+    for (std::size_t i = 0; i < size; i++) {
+        value |= std::uint32_t(data[i]) << (8*i);
+    }
+    return value;
+}
+
+}
+
+std::size_t Framer::checkSize() const
+{
+    switch (config.check) {
+    case CHECK_CRC16:
+        return 2;
+    case CHECK_CRC32:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+std::size_t Framer::frameLength(const unsigned char *header) const
+{
+    std::size_t length = readLE(header, config.lengthSize);
+    if (!config.lengthIncludesHeader) {
+        length += config.lengthSize;
+    }
+    if (length < config.lengthSize + checkSize() || length > config.maxFrameSize) {
+        return 0;
+    }
+    return length;
+}
+
+std::size_t Framer::completeCarry(unsigned char *data, std::size_t size)
+{
+    std::size_t consumed = 0;
+    switch (config.mode) {
+    case MODE_FIXED: {
+        consumed = config.frameSize - carry.size();
+        if (consumed > size) {
+            consumed = size;
+        }
+        carry.insert(carry.end(), data, data + consumed);
+        if (carry.size() == config.frameSize) {
+            emit(carry.data(), carry.size());
+            carry.clear();
+        }
+        break;
+    }
+    case MODE_LENGTH: {
+        if (carry.size() < config.lengthSize) {
+            consumed = config.lengthSize - carry.size();
+            if (consumed > size) {
+                consumed = size;
+            }
+            carry.insert(carry.end(), data, data + consumed);
+            if (carry.size() < config.lengthSize) {
+                break;
+            }
+        }
+        std::size_t length = frameLength(carry.data());
+        if (length == 0) {
+            malformed++;
+            droppedBytes += carry.size();
+            carry.clear();
+            break;
+        }
+        std::size_t n = length - carry.size();
+        if (n > size - consumed) {
+            n = size - consumed;
+        }
+        carry.insert(carry.end(), data + consumed, data + consumed + n);
+        consumed += n;
+        if (carry.size() == length) {
+            emit(carry.data(), carry.size());
+            carry.clear();
+        }
+        break;
+    }
+    default: {
+        unsigned char delimiter = config.mode == MODE_COBS ? 0 : config.delimiter;
+        const unsigned char *end = static_cast<const unsigned char*>(memchr(data, delimiter, size));
+        std::size_t n = end == nullptr ? size : std::size_t(end - data);
+        consumed = end == nullptr ? size : n + 1;
+        if (isDiscarding) {
+            droppedBytes += n;
+            isDiscarding = end == nullptr;
+            break;
+        }
+        if (carry.size() + n > config.maxFrameSize) {
+            malformed++;
+            droppedBytes += carry.size() + n;
+            carry.clear();
+            isDiscarding = end == nullptr;
+            break;
+        }
+        carry.insert(carry.end(), data, data + n);
+        if (end != nullptr) {
+            emit(carry.data(), carry.size());
+            carry.clear();
+        }
+        break;
+    }
+    }
+    return consumed;
+}
+
+void Framer::keep(const unsigned char *data, std::size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    if (size > config.maxFrameSize) {
+        malformed++;
+        droppedBytes += size;
+        isDiscarding = config.mode == MODE_DELIMITER || config.mode == MODE_COBS;
+        return;
+    }
+    carry.assign(data, data + size);
+    return;
+}
+
+void Framer::emit(unsigned char *data, std::size_t size)
+{
+    if (config.mode == MODE_COBS && !cobsDecode(data, size)) {
+        malformed++;
+        return;
+    }
+    if (size == 0) {
+        /* back to back delimiters */
+        return;
+    }
+    std::size_t crcSize = checkSize();
+    if (size < crcSize) {
+        malformed++;
+        return;
+    }
+    std::size_t length = size - crcSize;
+    if (config.check == CHECK_CRC16) {
+        if (crc16(data, length) != readLE(data + length, 2)) {
+            checkErrors++;
+            return;
+        }
+    } else if (config.check == CHECK_CRC32) {
+        if (crc32(data, length) != readLE(data + length, 4)) {
+            checkErrors++;
+            return;
+        }
+    }
+    if (config.mode == MODE_LENGTH) {
+        data += config.lengthSize;
+        length -= config.lengthSize;
+    }
+    frames++;
+    frame(data, length);
+    return;
+}
+
+bool Framer::cobsDecode(unsigned char *data, std::size_t &size)
+{
+    /* the output never overtakes the input, so decoding in place is safe */
+    std::size_t in = 0;
+    std::size_t out = 0;
+    while (in < size) {
+        unsigned char code = data[in++];
+        if (code == 0 || in + code - 1 > size) {
+            return false;
+        }
+        for (unsigned char i = 1; i < code; i++) {
+            data[out++] = data[in++];
+        }
+        if (code != 0xff && in < size) {
+            data[out++] = 0;
+        }
+    }
+    size = out;
+    return true;
+}
+
+Framer::Framer(const Framer::Config &config_):
+    isDiscarding(false),
+    frames(0),
+    checkErrors(0),
+    malformed(0),
+    droppedBytes(0)
+{
+    frame = [](unsigned char*, std::size_t){};
+    setConfig(config_);
+}
+
+void Framer::setConfig(const Framer::Config &config_)
+{
+    config = config_;
+    if (config.lengthSize != 1 && config.lengthSize != 2 && config.lengthSize != 4) {
+        config.lengthSize = 2;
+    }
+    carry.clear();
+    carry.reserve(config.maxFrameSize);
+    isDiscarding = false;
+    return;
+}
+
+void Framer::push(unsigned char *data, std::size_t size)
+{
+    if (data == nullptr || size == 0 || (config.mode == MODE_FIXED && config.frameSize == 0)) {
+        return;
+    }
+    std::size_t pos = 0;
+    if (!carry.empty() || isDiscarding) {
+        pos = completeCarry(data, size);
+        if (!carry.empty() || isDiscarding) {
+            return;
+        }
+    }
+    /* everything from here on is delivered straight out of the caller's buffer */
+    unsigned char *p = data + pos;
+    std::size_t remain = size - pos;
+    switch (config.mode) {
+    case MODE_FIXED:
+        while (remain >= config.frameSize) {
+            emit(p, config.frameSize);
+            p += config.frameSize;
+            remain -= config.frameSize;
+        }
+        break;
+    case MODE_LENGTH:
+        while (remain >= config.lengthSize) {
+            std::size_t length = frameLength(p);
+            if (length == 0) {
+                /* no way to find the next prefix, drop the rest of the buffer */
+                malformed++;
+                droppedBytes += remain;
+                return;
+            }
+            if (remain < length) {
+                break;
+            }
+            emit(p, length);
+            p += length;
+            remain -= length;
+        }
+        break;
+    default: {
+        /* memchr is the vectorized scan of the c library */
+        unsigned char delimiter = config.mode == MODE_COBS ? 0 : config.delimiter;
+        while (remain > 0) {
+            unsigned char *end = static_cast<unsigned char*>(memchr(p, delimiter, remain));
+            if (end == nullptr) {
+                break;
+            }
+            std::size_t n = end - p;
+            emit(p, n);
+            p = end + 1;
+            remain -= n + 1;
+        }
+        break;
+    }
+    }
+    keep(p, remain);
+    return;
+}
+
+Framer::FnProcess Framer::processor()
+{
+    return [this](unsigned char *data, std::size_t size) {
+        push(data, size);
+    };
+}
+
+void Framer::reset()
+{
+    carry.clear();
+    isDiscarding = false;
+    frames = 0;
+    checkErrors = 0;
+    malformed = 0;
+    droppedBytes = 0;
+    return;
+}
+
+Framer::Stats Framer::getStats() const
+{
+    Stats stats;
+    stats.frames = frames.load();
+    stats.checkErrors = checkErrors.load();
+    stats.malformed = malformed.load();
+    stats.droppedBytes = droppedBytes.load();
+    return stats;
+}
+
+std::uint16_t Framer::crc16(const unsigned char *data, std::size_t size, std::uint16_t crc)
+{
+    static const Crc16Table t;
+    for (std::size_t i = 0; i < size; i++) {
+        crc = (crc << 8) ^ t.table[((crc >> 8) ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+std::uint32_t Framer::crc32(const unsigned char *data, std::size_t size, std::uint32_t crc)
+{
+    static const Crc32Table t;
+    crc = ~crc;
+    /* eight bytes per step instead of one table lookup per byte */
+    while (size >= 8) {
+        std::uint32_t one = crc ^ readLE(data, 4);
+        std::uint32_t two = readLE(data + 4, 4);
+        crc = t.table[7][one & 0xff] ^ t.table[6][(one >> 8) & 0xff] ^
+              t.table[5][(one >> 16) & 0xff] ^ t.table[4][one >> 24] ^
+              t.table[3][two & 0xff] ^ t.table[2][(two >> 8) & 0xff] ^
+              t.table[1][(two >> 16) & 0xff] ^ t.table[0][two >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = t.table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,92 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+/* reassembles device messages that span or share transfers. Frames that
+   lie inside one buffer are checked and delivered in place, only a frame
+   cut by a transfer boundary is carried over into a copy. Feed it through
+   processor() from UsbAsync::registerProcess or Hid::registerProcess. */
+class Framer
+{
+public:
+    enum Mode {
+        MODE_FIXED = 0,
+        MODE_LENGTH,
+        MODE_DELIMITER,
+        MODE_COBS
+    };
+    enum Check {
+        CHECK_NONE = 0,
+        /* ccitt, poly 0x1021 init 0xffff */
+        CHECK_CRC16,
+        /* ieee 802.3 */
+        CHECK_CRC32
+    };
+    using FnFrame = std::function<void(unsigned char*, std::size_t)>;
+    using FnProcess = std::function<void(unsigned char*, std::size_t)>;
+    constexpr static std::size_t default_max_frame_size = 64*1024;
+
+    struct Config
+    {
+        int mode;
+        /* MODE_FIXED: bytes per frame, crc included */
+        std::size_t frameSize;
+        /* MODE_LENGTH: 1, 2 or 4 byte little endian prefix counting the bytes
+           after it, or the whole frame when lengthIncludesHeader */
+        std::size_t lengthSize;
+        bool lengthIncludesHeader;
+        /* MODE_DELIMITER: end of frame marker, the frame must not contain it,
+           binary payloads and crcs want MODE_COBS which always uses 0 */
+        unsigned char delimiter;
+        /* little endian crc at the end of the frame over every byte before it,
+           the prefix included, checked and stripped before delivery */
+        int check;
+        std::size_t maxFrameSize;
+        Config():mode(MODE_LENGTH), frameSize(0), lengthSize(2), lengthIncludesHeader(false),
+            delimiter('\n'), check(CHECK_NONE), maxFrameSize(default_max_frame_size){}
+    };
+
+    struct Stats
+    {
+        std::uint64_t frames;
+        std::uint64_t checkErrors;
+        /* bad length prefix, broken cobs or a frame over maxFrameSize */
+        std::uint64_t malformed;
+        std::uint64_t droppedBytes;
+    };
+protected:
+    Config config;
+    FnFrame frame;
+    std::vector<unsigned char> carry;
+    /* delimiter modes skip to the next delimiter after an oversized frame */
+    bool isDiscarding;
+    std::atomic<std::uint64_t> frames;
+    std::atomic<std::uint64_t> checkErrors;
+    std::atomic<std::uint64_t> malformed;
+    std::atomic<std::uint64_t> droppedBytes;
+protected:
+    std::size_t checkSize() const;
+    /* whole frame size from a complete prefix, 0 when invalid */
+    std::size_t frameLength(const unsigned char *header) const;
+    std::size_t completeCarry(unsigned char *data, std::size_t size);
+    void keep(const unsigned char *data, std::size_t size);
+    void emit(unsigned char *data, std::size_t size);
+    /* in place, size becomes the decoded length */
+    static bool cobsDecode(unsigned char *data, std::size_t &size);
+public:
+    explicit Framer(const Config &config_ = Config());
+    void setConfig(const Config &config_);
+    void registerFrame(const FnFrame &func) {frame = func;}
+    /* buffers must be writable, cobs decodes in place */
+    void push(unsigned char *data, std::size_t size);
+    FnProcess processor();
+    void reset();
+    Stats getStats() const;
+    static std::uint16_t crc16(const unsigned char *data, std::size_t size, std::uint16_t crc = 0xffff);
+    static std::uint32_t crc32(const unsigned char *data, std::size_t size, std::uint32_t crc = 0);
+};
+
+#endif // FRAMER_H
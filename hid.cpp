@@ -4,15 +4,20 @@ Hid::Init Hid::init;
 
 void Hid::recv()
 {
+    recvThreadStatus = recvThreadConfig.apply();
+    /* allocate from this thread so the cache lands on the pinned node */
+    std::size_t cacheSize = backend == BACKEND_HIDRAW ? max_recv_size*hidraw_slot_num : max_recv_size;
+    recvCache = static_cast<unsigned char*>(recvThreadConfig.allocate(cacheSize));
     while (1) {
         {
             std::unique_lock<std::mutex> locker(mutex);
             condit.wait(locker, [=]()->bool{
                 return state == STATE_PREPEND || state == STATE_OPENED ||
-                        state == STATE_RUN || state == STATE_TERMINATE;
+                        state == STATE_RUN || state == STATE_CLOSE || state == STATE_TERMINATE;
             });
             if (state == STATE_TERMINATE) {
                 state = STATE_PREPEND;
+                flush();
                 break;
             } else if (state == STATE_PREPEND) {
                 int ret = 0;
@@ -22,6 +27,10 @@ void Hid::recv()
                     ret = openDevice(property.vendorID, property.productID, property.usagePage, property.usage);
                 }
                 if (ret != HID_SUCCESS) {
+                    /* stop() cuts the wait short */
+                    condit.wait_for(locker, std::chrono::milliseconds(reopen_interval), [=]()->bool{
+                        return state != STATE_PREPEND;
+                    });
                     continue;
                 } else {
                     state = STATE_RUN;
@@ -34,40 +43,151 @@ void Hid::recv()
             }
         }
 
-        int len = hid_read(handle, recvCache, max_recv_size);
+        if (backend == BACKEND_HIDRAW) {
+            if (recvRaw() < 0) {
+                flush();
+                notify(false);
+                hidraw.close();
+                state = STATE_PREPEND;
+            }
+            expire();
+            continue;
+        }
+        /* a pending batch bounds the wait so it goes out on time */
+        int timeout = batchTimeout();
+        int len = timeout < 0 ? hid_read(handle, recvCache, max_recv_size) :
+                                hid_read_timeout(handle, recvCache, max_recv_size, timeout);
         if (len < 0) {
+            flush();
             notify(false);
-            handle = nullptr;
+            /* the handle of an unplugged device still has to be freed */
+            closeDevice();
             state = STATE_PREPEND;
             continue;
         }
-        if (len == 0) {
-            continue;
+        if (len > 0) {
+            dispatch(recvCache, len, ClockSync::now());
         }
+        expire();
+    }
+    recvThreadConfig.release(recvCache, cacheSize);
+    recvCache = nullptr;
+    return;
+}
+
+int Hid::recvRaw()
+{
+    /* full size slots: hidraw cuts a report silently to its slot, and the
+       parsed input size is not trusted to be the kernel's. A report shorter
+       than its slot ends the readv, so this reads one report per call */
+    const std::size_t slotSize = max_recv_size;
+    std::size_t lengths[hidraw_slot_num];
+    int timeout = batchTimeout();
+    if (timeout < 0 || timeout > hidraw_poll_timeout) {
+        timeout = hidraw_poll_timeout;
+    }
+    int count = hidraw.readSlots(recvCache, slotSize, hidraw_slot_num, lengths, timeout);
+    /* hidraw keeps no arrival time, a batch shares the time of its readv */
+    long long timestamp = ClockSync::now();
+    for (int i = 0; i < count; i++) {
+        dispatch(recvCache + i*slotSize, lengths[i], timestamp);
+    }
+    return count;
+}
+
+void Hid::dispatch(unsigned char *data, std::size_t size, long long timestamp)
+{
+    if (isBatched) {
+        collect(data, size, timestamp);
+    } else if (isTimed) {
+        timedProcess(data, size, timestamp);
+    } else {
+        process(data, size);
+    }
+    return;
+}
+
+void Hid::collect(unsigned char *data, std::size_t size, long long timestamp)
+{
+    if (lastArrival != 0) {
+        interval += (double(timestamp - lastArrival) - interval)/8;
+    } else if (coalesce.lowRate > 0) {
+        /* start out as low rate until the reports prove otherwise */
+        interval = 2e9/coalesce.lowRate;
+    }
+    lastArrival = timestamp;
+    if (batchUsed + size > batchBuffer.size()) {
+        flush();
+    }
+    memcpy(batchBuffer.data() + batchUsed, data, size);
+    Report report;
+    report.data = batchBuffer.data() + batchUsed;
+    report.size = size;
+    report.timestamp = timestamp;
+    batch.push_back(report);
+    batchUsed += size;
+    /* at low rates waiting for company only adds latency */
+    bool isLowRate = coalesce.lowRate == 0 || interval > 1e9/coalesce.lowRate;
+    if (isLowRate || batch.size() >= coalesce.maxCount) {
+        flush();
+    }
+    return;
+}
+
+void Hid::flush()
+{
+    if (batch.empty()) {
+        return;
+    }
+    batchProcess(batch.data(), batch.size());
+    batch.clear();
+    batchUsed = 0;
+    return;
+}
+
+int Hid::batchTimeout() const
+{
+    if (batch.empty()) {
+        return -1;
+    }
+    long long due = batch.front().timestamp + (long long)(coalesce.window)*1000;
+    long long remain = due - ClockSync::now();
+    /* round up, hid_read_timeout and poll count whole milliseconds */
+    return remain <= 0 ? 0 : int((remain + 999999)/1000000);
+}
 
-        process(recvCache, len);
+void Hid::expire()
+{
+    if (!batch.empty() && batchTimeout() == 0) {
+        flush();
     }
     return;
 }
 
 Hid::Hid():
     handle(nullptr),
+    backend(BACKEND_HIDAPI),
+    isNonBlock(false),
+    isTimed(false),
+    isBatched(false),
+    batchUsed(0),
+    interval(0),
+    lastArrival(0),
     state(STATE_PREPEND),
     specifiedUsage(false),
-    recvCache(nullptr)
+    recvCache(nullptr),
+    recvThreadStatus(ThreadConfig::THREAD_SUCCESS)
 {
-    recvCache = new unsigned char[max_recv_size];
     process = [](unsigned char*, std::size_t){};
+    timedProcess = [](unsigned char*, std::size_t, long long){};
+    batchProcess = [](const Report*, std::size_t){};
     notify = [](bool){};
 }
 
 Hid::~Hid()
 {
-    if (recvCache != nullptr) {
-        delete [] recvCache;
-        recvCache = nullptr;
-    }
-    if (state != STATE_PREPEND) {
+    /* recv may already be back in STATE_PREPEND after a read error */
+    if (recvThread.joinable()) {
         stop();
         recvThread.join();
     }
@@ -79,6 +199,7 @@ std::vector<Hid::Property> Hid::enumerate()
     struct hid_device_info *devs = nullptr;
     struct hid_device_info *curDevice = nullptr;
 
+    init.get();
     devs = hid_enumerate(0x0, 0x0);
     curDevice = devs;
     while (curDevice != nullptr) {
@@ -96,9 +217,18 @@ std::vector<Hid::Property> Hid::enumerate()
 
 int Hid::openDevice(unsigned short vid, unsigned short pid)
 {
+    if (backend == BACKEND_HIDRAW) {
+        if (hidraw.open(vid, pid) < 0) {
+            return HID_OPEN_FAILED;
+        }
+        property.vendorID = vid;
+        property.productID = pid;
+        return HID_SUCCESS;
+    }
     if (handle != nullptr) {
         return HID_SUCCESS;
     }
+    init.get();
     handle = hid_open(vid, pid, nullptr);
     if (handle == nullptr) {
         return HID_OPEN_FAILED;
@@ -110,12 +240,24 @@ int Hid::openDevice(unsigned short vid, unsigned short pid)
 
 int Hid::openDevice(unsigned short vid, unsigned short pid, unsigned short usagePage, unsigned short usage)
 {
+    if (backend == BACKEND_HIDRAW) {
+        if (hidraw.open(vid, pid, usagePage, usage) < 0) {
+            return HID_OPEN_FAILED;
+        }
+        property.vendorID = vid;
+        property.productID = pid;
+        property.usagePage = usagePage;
+        property.usage = usage;
+        specifiedUsage = true;
+        return HID_SUCCESS;
+    }
     if (handle != nullptr) {
         return HID_SUCCESS;
     }
     struct hid_device_info *devs = nullptr;
     struct hid_device_info *dev = nullptr;
     const char *devPath = nullptr;
+    init.get();
     devs = hid_enumerate(vid, pid);
     dev = devs;
     while (dev != nullptr) {
@@ -141,14 +283,29 @@ int Hid::openDevice(unsigned short vid, unsigned short pid, unsigned short usage
 
 void Hid::closeDevice()
 {
+    hidraw.close();
     if (handle != nullptr) {
         hid_close(handle);
+        handle = nullptr;
     }
     return;
 }
 
+int Hid::setBackend(int backend_)
+{
+    if (backend_ == BACKEND_HIDRAW && !HidRaw::isSupported()) {
+        return HID_UNSUPPORT;
+    }
+    if (handle != nullptr || hidraw.isOpen() || state != STATE_PREPEND) {
+        return HID_INVALID_PARAM;
+    }
+    backend = backend_;
+    return HID_SUCCESS;
+}
+
 void Hid::setNonBlock(bool on)
 {
+    isNonBlock = on;
     if (handle == nullptr) {
         return;
     }
@@ -159,17 +316,69 @@ void Hid::setNonBlock(bool on)
 void Hid::registerProcess(const Hid::FnProcess &func)
 {
     process = func;
+    isTimed = false;
+    isBatched = false;
+    return;
+}
+
+void Hid::registerTimedProcess(const Hid::FnTimedProcess &func)
+{
+    timedProcess = func;
+    isTimed = true;
+    isBatched = false;
     return;
 }
 
+int Hid::registerBatchProcess(const Hid::FnBatchProcess &func, const Hid::Coalesce &coalesce_)
+{
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        if (state != STATE_PREPEND || recvThread.joinable()) {
+            return HID_INVALID_PARAM;
+        }
+    }
+    batchProcess = func;
+    coalesce = coalesce_;
+    if (coalesce.maxCount == 0 || coalesce.maxCount > max_batch_num) {
+        coalesce.maxCount = max_batch_num;
+    }
+    /* sized once so report pointers stay valid while a batch fills */
+    batchBuffer.assign(coalesce.maxCount*max_recv_size, 0);
+    batch.reserve(coalesce.maxCount);
+    batchUsed = 0;
+    interval = 0;
+    lastArrival = 0;
+    isBatched = true;
+    return HID_SUCCESS;
+}
+
 void Hid::registerNotify(const Hid::FnNotify &func)
 {
     notify = func;
     return;
 }
 
+void Hid::setRecvThreadConfig(const ThreadConfig &config)
+{
+    recvThreadConfig = config;
+    return;
+}
+
 int Hid::write(const unsigned char *data, std::size_t datasize)
 {
+    if (backend == BACKEND_HIDRAW) {
+        /* hidraw takes the report as is, no padding to max_send_size */
+        std::size_t pos = 0;
+        while (pos < datasize) {
+            std::size_t len = datasize - pos > max_send_size ? max_send_size : datasize - pos;
+            int ret = hidraw.write(data + pos, len);
+            if (ret <= 0) {
+                return HID_WRITE_FAILED;
+            }
+            pos += ret;
+        }
+        return HID_SUCCESS;
+    }
     if (handle == nullptr) {
         return HID_OPEN_FAILED;
     }
@@ -216,6 +425,14 @@ int Hid::write(const std::string &data)
 
 int Hid::read(unsigned char *&data, size_t &datasize)
 {
+    if (backend == BACKEND_HIDRAW) {
+        int len = hidraw.read(data, datasize, isNonBlock ? 0 : -1);
+        if (len < 0) {
+            return HID_READ_FAILED;
+        }
+        datasize = len;
+        return HID_SUCCESS;
+    }
     if (handle == nullptr) {
         return HID_OPEN_FAILED;
     }
@@ -230,6 +447,10 @@ int Hid::read(unsigned char *&data, size_t &datasize)
 
 int Hid::sendFeatureReport(const unsigned char *data, size_t datasize)
 {
+    if (backend == BACKEND_HIDRAW) {
+        return hidraw.sendFeatureReport(data, datasize) < 0 ?
+                    HID_SEND_FEATURE_REPORT_FAILED : HID_SUCCESS;
+    }
     if (handle == nullptr) {
         return HID_OPEN_FAILED;
     }
@@ -242,6 +463,14 @@ int Hid::sendFeatureReport(const unsigned char *data, size_t datasize)
 
 int Hid::recvFeatureReport(unsigned char *&data, size_t &datasize)
 {
+    if (backend == BACKEND_HIDRAW) {
+        int len = hidraw.getFeatureReport(data, datasize);
+        if (len < 0) {
+            return HID_RECV_FEATURE_REPORT_FAILED;
+        }
+        datasize = len;
+        return HID_SUCCESS;
+    }
     if (handle == nullptr) {
         return HID_OPEN_FAILED;
     }
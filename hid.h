@@ -4,16 +4,43 @@
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <functional>
 #include <condition_variable>
+#include <cstring>
 #include "hidapi/hidapi.h"
+#include "threadconfig.h"
+#include "hidraw.h"
+#include "clocksync.h"
 
 
 class Hid
 {
 public:
     using FnProcess = std::function<void(unsigned char*, std::size_t)>;
+    /* timestamp: ClockSync::now() when the read returned */
+    using FnTimedProcess = std::function<void(unsigned char*, std::size_t, long long)>;
     using FnNotify = std::function<void(bool)>;
+    /* one report of a coalesced batch, valid until the callback returns */
+    struct Report
+    {
+        unsigned char *data;
+        std::size_t size;
+        long long timestamp;
+    };
+    using FnBatchProcess = std::function<void(const Report*, std::size_t)>;
+    /* when reports are held back to share one callback */
+    struct Coalesce
+    {
+        /* longest the first report of a batch waits, in microseconds */
+        int window;
+        std::size_t maxCount;
+        /* below this many reports per second every report goes out alone */
+        unsigned int lowRate;
+        Coalesce():window(1000), maxCount(32), lowRate(500){}
+        Coalesce(int window_, std::size_t maxCount_, unsigned int lowRate_ = 500):
+            window(window_), maxCount(maxCount_), lowRate(lowRate_){}
+    };
     enum State {
         STATE_PREPEND = 0,
         STATE_OPENED,
@@ -28,7 +55,13 @@ public:
         HID_WRITE_FAILED,
         HID_READ_FAILED,
         HID_SEND_FEATURE_REPORT_FAILED,
-        HID_RECV_FEATURE_REPORT_FAILED
+        HID_RECV_FEATURE_REPORT_FAILED,
+        HID_INVALID_PARAM,
+        HID_UNSUPPORT
+    };
+    enum Backend {
+        BACKEND_HIDAPI = 0,
+        BACKEND_HIDRAW
     };
 
     struct Property {
@@ -38,38 +71,98 @@ public:
         unsigned short usage;
     };
 
+    /* hid_init on first use instead of at static initialization */
     class Init
     {
     public:
-        Init()  {hid_init();}
-        ~Init() {hid_exit(); }
+        std::mutex mutex;
+        std::atomic_bool isReady;
+    public:
+        Init():isReady(false){}
+        ~Init()
+        {
+            if (isReady.load()) {
+                hid_exit();
+            }
+        }
+        bool get()
+        {
+            if (isReady.load(std::memory_order_acquire)) {
+                return true;
+            }
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!isReady.load(std::memory_order_relaxed) && hid_init() == 0) {
+                isReady.store(true, std::memory_order_release);
+            }
+            return isReady.load(std::memory_order_relaxed);
+        }
     };
     constexpr static std::size_t max_recv_size = 1024;
     constexpr static std::size_t max_send_size = 1024;
+    /* hidraw: reports per readv and how long recv waits before checking the state */
+    constexpr static std::size_t hidraw_slot_num = 32;
+    constexpr static int hidraw_poll_timeout = 100;
+    /* backoff between attempts to reopen a missing device */
+    constexpr static int reopen_interval = 100;
+    constexpr static std::size_t max_batch_num = 256;
     static Init init;
 protected:
     Property property;
     hid_device *handle;
+    int backend;
+    HidRaw hidraw;
+    bool isNonBlock;
     std::thread recvThread;
     std::mutex mutex;
     std::condition_variable condit;
     FnProcess process;
+    FnTimedProcess timedProcess;
+    bool isTimed;
+    /* coalescing */
+    FnBatchProcess batchProcess;
+    bool isBatched;
+    Coalesce coalesce;
+    std::vector<unsigned char> batchBuffer;
+    std::size_t batchUsed;
+    std::vector<Report> batch;
+    /* smoothed gap between reports in ns */
+    double interval;
+    long long lastArrival;
     FnNotify notify;
     int state;
     bool specifiedUsage;
     unsigned char* recvCache;
+    ThreadConfig recvThreadConfig;
+    std::atomic<int> recvThreadStatus;
 protected:
     void recv();
+    int recvRaw();
+    void dispatch(unsigned char *data, std::size_t size, long long timestamp);
+    void collect(unsigned char *data, std::size_t size, long long timestamp);
+    void flush();
+    /* ms until the pending batch is due, -1 when nothing waits */
+    int batchTimeout() const;
+    void expire();
 public:
     Hid();
     ~Hid();
+    static bool initialize() {return init.get();}
     static std::vector<Hid::Property> enumerate();
     int openDevice(unsigned short vid, unsigned short pid);
     int openDevice(unsigned short vid, unsigned short pid, unsigned short usagePage, unsigned short usage);
     void closeDevice();
+    /* takes effect on the next open */
+    int setBackend(int backend_);
+    int getBackend() const {return backend;}
     void setNonBlock(bool on);
     void registerProcess(const FnProcess &func);
+    void registerTimedProcess(const FnTimedProcess &func);
+    /* register before start, the recv thread fills the batch buffer without a lock */
+    int registerBatchProcess(const FnBatchProcess &func, const Coalesce &coalesce_ = Coalesce());
     void registerNotify(const FnNotify &func);
+    void setRecvThreadConfig(const ThreadConfig &config);
+    /* ThreadConfig code of the last recv thread start */
+    int getRecvThreadStatus() const {return recvThreadStatus.load();}
     int write(const unsigned char *data, std::size_t datasize);
     int write(const std::string &data);
     int read(unsigned char* &data, std::size_t & datasize);
@@ -0,0 +1,360 @@
+#include "hidraw.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <vector>
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/hidraw.h>
+#endif
+
+void HidRaw::parse(const unsigned char *descriptor, std::size_t size, HidRaw::Property &property)
+{
+    /* global items that push and pop save and restore */
+    struct Global
+    {
+        unsigned int usagePage;
+        unsigned int reportSize;
+        unsigned int reportCount;
+        unsigned int reportID;
+    };
+    std::map<unsigned int, std::size_t> inputBits;
+    std::vector<Global> stack;
+    Global global = {0, 0, 0, 0};
+    bool topLevel = true;
+    std::size_t i = 0;
+    while (i < size) {
+        unsigned char prefix = descriptor[i];
+        if (prefix == 0xfe) {
+            /* long item */
+            if (i + 1 >= size) {
+                break;
+            }
+            i += 3 + descriptor[i + 1];
+            continue;
+        }
+        std::size_t length = prefix & 0x3;
+        if (length == 3) {
+            length = 4;
+        }
+        if (i + 1 + length > size) {
+            break;
+        }
+        unsigned int value = 0;
+        for (std::size_t j = 0; j < length; j++) {
+            value |= unsigned(descriptor[i + 1 + j]) << (8*j);
+        }
+        switch (prefix & 0xfc) {
+        case 0x04:
+            global.usagePage = value;
+            break;
+        case 0x08:
+            if (topLevel && property.usage == 0) {
+                /* a 4 byte usage carries its own page */
+                property.usagePage = length == 4 ? (value >> 16) : global.usagePage;
+                property.usage = value & 0xffff;
+            }
+            break;
+        case 0xa0:
+            topLevel = false;
+            break;
+        case 0x74:
+            global.reportSize = value;
+            break;
+        case 0x94:
+            global.reportCount = value;
+            break;
+        case 0x84:
+            global.reportID = value;
+            break;
+        case 0xa4:
+            stack.push_back(global);
+            break;
+        case 0xb4:
+            if (!stack.empty()) {
+                global = stack.back();
+                stack.pop_back();
+            }
+            break;
+        case 0x80:
+            inputBits[global.reportID] += std::size_t(global.reportSize)*global.reportCount;
+            break;
+        default:
+            break;
+        }
+        i += 1 + length;
+    }
+    property.inputSize = 0;
+    for (auto it = inputBits.begin(); it != inputBits.end(); ++it) {
+        std::size_t bytes = (it->second + 7)/8 + (it->first != 0 ? 1 : 0);
+        if (bytes > property.inputSize) {
+            property.inputSize = bytes;
+        }
+    }
+    return;
+}
+
+bool HidRaw::readProperty(const std::string &name, HidRaw::Property &property)
+{
+#ifdef __linux__
+    std::string sysPath = "/sys/class/hidraw/" + name + "/device/";
+    FILE *file = fopen((sysPath + "uevent").c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    bool found = false;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        unsigned int bus = 0;
+        unsigned int vid = 0;
+        unsigned int pid = 0;
+        if (sscanf(line, "HID_ID=%x:%x:%x", &bus, &vid, &pid) == 3) {
+            property.vendorID = vid;
+            property.productID = pid;
+            found = true;
+            break;
+        }
+    }
+    fclose(file);
+    if (!found) {
+        return false;
+    }
+    property.path = "/dev/" + name;
+    /* sysfs exposes the descriptor without opening the node */
+    file = fopen((sysPath + "report_descriptor").c_str(), "rb");
+    if (file != nullptr) {
+        unsigned char descriptor[max_descriptor_size];
+        std::size_t size = fread(descriptor, 1, sizeof(descriptor), file);
+        fclose(file);
+        parse(descriptor, size, property);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+HidRaw::HidRaw():
+    fd(-1)
+{
+
+}
+
+HidRaw::~HidRaw()
+{
+    close();
+}
+
+bool HidRaw::isSupported()
+{
+#ifdef __linux__
+    return access("/sys/class/hidraw", R_OK) == 0;
+#else
+    return false;
+#endif
+}
+
+std::vector<HidRaw::Property> HidRaw::enumerate()
+{
+    std::vector<HidRaw::Property> devices;
+#ifdef __linux__
+    DIR *dir = opendir("/sys/class/hidraw");
+    if (dir == nullptr) {
+        return devices;
+    }
+    struct dirent *entry = nullptr;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0) {
+            continue;
+        }
+        Property device;
+        if (readProperty(entry->d_name, device)) {
+            devices.push_back(device);
+        }
+    }
+    closedir(dir);
+#endif
+    return devices;
+}
+
+int HidRaw::open(unsigned short vid, unsigned short pid)
+{
+    std::vector<Property> devices = enumerate();
+    for (std::size_t i = 0; i < devices.size(); i++) {
+        if (devices[i].vendorID == vid && devices[i].productID == pid) {
+            return open(devices[i]);
+        }
+    }
+    return -ENODEV;
+}
+
+int HidRaw::open(unsigned short vid, unsigned short pid, unsigned short usagePage, unsigned short usage)
+{
+    std::vector<Property> devices = enumerate();
+    for (std::size_t i = 0; i < devices.size(); i++) {
+        if (devices[i].vendorID == vid && devices[i].productID == pid &&
+                devices[i].usagePage == usagePage && devices[i].usage == usage) {
+            return open(devices[i]);
+        }
+    }
+    return -ENODEV;
+}
+
+int HidRaw::open(const HidRaw::Property &property_)
+{
+#ifdef __linux__
+    if (fd >= 0) {
+        return 0;
+    }
+    /* non blocking, waiting is done with poll so readv can stop early */
+    fd = ::open(property_.path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    property = property_;
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+void HidRaw::close()
+{
+#ifdef __linux__
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+    return;
+}
+
+int HidRaw::read(unsigned char *data, std::size_t size, int timeout)
+{
+    std::size_t length = 0;
+    int ret = readSlots(data, size, 1, &length, timeout);
+    return ret > 0 ? int(length) : ret;
+}
+
+int HidRaw::readSlots(unsigned char *slots, std::size_t slotSize, std::size_t slotNum,
+                      std::size_t *lengths, int timeout)
+{
+#ifdef __linux__
+    if (fd < 0 || slots == nullptr || slotSize == 0 || slotNum == 0) {
+        return -EINVAL;
+    }
+    if (slotNum > max_slot_num) {
+        slotNum = max_slot_num;
+    }
+    if (timeout != 0) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0) {
+            return errno == EINTR ? 0 : -errno;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            return -ENODEV;
+        }
+        if (ret == 0) {
+            return 0;
+        }
+    }
+    /* hidraw hands out one report per read, readv stops at the first
+       report shorter than its slot or when the queue runs dry */
+    struct iovec iov[max_slot_num];
+    for (std::size_t i = 0; i < slotNum; i++) {
+        iov[i].iov_base = slots + i*slotSize;
+        iov[i].iov_len = slotSize;
+    }
+    ssize_t total = readv(fd, iov, int(slotNum));
+    if (total < 0) {
+        return errno == EAGAIN ? 0 : -errno;
+    }
+    std::size_t count = std::size_t(total)/slotSize;
+    for (std::size_t i = 0; i < count; i++) {
+        lengths[i] = slotSize;
+    }
+    if (std::size_t(total)%slotSize != 0) {
+        lengths[count] = std::size_t(total)%slotSize;
+        count++;
+    }
+    return int(count);
+#else
+    return -ENOSYS;
+#endif
+}
+
+int HidRaw::write(const unsigned char *data, std::size_t size)
+{
+#ifdef __linux__
+    if (fd < 0 || data == nullptr) {
+        return -EINVAL;
+    }
+    ssize_t ret = ::write(fd, data, size);
+    return ret < 0 ? -errno : int(ret);
+#else
+    return -ENOSYS;
+#endif
+}
+
+int HidRaw::sendFeatureReport(const unsigned char *data, std::size_t size)
+{
+#ifdef __linux__
+    if (fd < 0 || data == nullptr) {
+        return -EINVAL;
+    }
+    int ret = ioctl(fd, HIDIOCSFEATURE(size), data);
+    return ret < 0 ? -errno : ret;
+#else
+    return -ENOSYS;
+#endif
+}
+
+int HidRaw::getFeatureReport(unsigned char *data, std::size_t size)
+{
+#ifdef __linux__
+    if (fd < 0 || data == nullptr) {
+        return -EINVAL;
+    }
+    /* data[0] selects the report id */
+    int ret = ioctl(fd, HIDIOCGFEATURE(size), data);
+    return ret < 0 ? -errno : ret;
+#else
+    return -ENOSYS;
+#endif
+}
+
+int HidRaw::wait(const std::vector<HidRaw*> &devices, std::vector<std::size_t> &ready, int timeout)
+{
+    ready.clear();
+#ifdef __linux__
+    std::vector<struct pollfd> pfds(devices.size());
+    for (std::size_t i = 0; i < devices.size(); i++) {
+        pfds[i].fd = devices[i]->fd;
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+    int ret = poll(pfds.data(), pfds.size(), timeout);
+    if (ret < 0) {
+        return errno == EINTR ? 0 : -errno;
+    }
+    /* hangups count as ready so the caller sees the error on read */
+    for (std::size_t i = 0; i < pfds.size(); i++) {
+        if (pfds[i].revents != 0) {
+            ready.push_back(i);
+        }
+    }
+    return int(ready.size());
+#else
+    return -ENOSYS;
+#endif
+}
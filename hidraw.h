@@ -0,0 +1,61 @@
+#ifndef HIDRAW_H
+#define HIDRAW_H
+#include <string>
+#include <vector>
+
+/* direct linux hidraw access (/dev/hidrawN), the alternative to hidapi for
+   Hid. Reports are read straight into caller buffers, several per syscall
+   when the slots match the input report size. Functions return the byte
+   count or report count, negative errno on failure. Other platforms
+   report -ENOSYS. */
+class HidRaw
+{
+public:
+    struct Property
+    {
+        std::string path;
+        unsigned short vendorID;
+        unsigned short productID;
+        /* top level collection of the report descriptor */
+        unsigned short usagePage;
+        unsigned short usage;
+        /* longest input report including the report id, 0 when unknown */
+        std::size_t inputSize;
+        Property():vendorID(0), productID(0), usagePage(0), usage(0), inputSize(0){}
+    };
+    constexpr static std::size_t max_descriptor_size = 4096;
+    constexpr static std::size_t max_slot_num = 64;
+protected:
+    int fd;
+    Property property;
+protected:
+    static void parse(const unsigned char *descriptor, std::size_t size, Property &property);
+    static bool readProperty(const std::string &name, Property &property);
+public:
+    HidRaw();
+    ~HidRaw();
+    static bool isSupported();
+    static std::vector<Property> enumerate();
+    bool isOpen() const {return fd >= 0;}
+    int handle() const {return fd;}
+    const Property& getProperty() const {return property;}
+    int open(unsigned short vid, unsigned short pid);
+    int open(unsigned short vid, unsigned short pid, unsigned short usagePage, unsigned short usage);
+    int open(const Property &property_);
+    void close();
+    /* one report, waits up to timeout ms (-1 forever), 0 when nothing came */
+    int read(unsigned char *data, std::size_t size, int timeout);
+    /* fills consecutive slots of slotSize bytes with one report each using a
+       single readv, lengths receives the size of every filled slot. Reports
+       longer than slotSize are cut without notice */
+    int readSlots(unsigned char *slots, std::size_t slotSize, std::size_t slotNum,
+                  std::size_t *lengths, int timeout);
+    /* the first byte is the report id, 0 for devices without ids */
+    int write(const unsigned char *data, std::size_t size);
+    int sendFeatureReport(const unsigned char *data, std::size_t size);
+    int getFeatureReport(unsigned char *data, std::size_t size);
+    /* poll several devices at once, ready gets the indexes with input */
+    static int wait(const std::vector<HidRaw*> &devices, std::vector<std::size_t> &ready, int timeout);
+};
+
+#endif // HIDRAW_H
@@ -1,6 +1,12 @@
 #include <iostream>
+#include <cstdlib>
+#include <string>
 #include "usb.h"
 #include "hid.h"
+#include "snapshot.h"
+#include "soak.h"
+#include "usbasync.h"
+#include "virtualhid.h"
 
 void test_enumerate_usb_device()
 {
@@ -20,8 +26,260 @@ void test_enumerate_hid_device()
     }
 }
 
-int main()
+void test_snapshot_device()
 {
-    test_enumerate_usb_device();
+    std::vector<Snapshot::Device> devs = Snapshot::take();
+    for (auto &x : devs) {
+        std::cout<<"bus:"<<int(x.bus)<<", address:"<<int(x.address)<<", speed:"<<x.speed
+                <<", vendorID:"<<x.vendorID<<", productID:"<<x.productID
+                <<", serial:"<<x.serial<<", endpoints:"<<int(x.endpointNum)
+                <<", usagePage:"<<x.usagePage<<", usage:"<<x.usage<<std::endl;
+    }
+    return;
+}
+
+/* loopback gadget (g_zero loopback or dummy_hcd): compare the read rate of
+   both backends and the write to read latency of the echoed packets */
+void test_bench_backend(unsigned short vendorID, unsigned short productID)
+{
+    int backends[2] = {Usb::BACKEND_LIBUSB, Usb::BACKEND_USBFS};
+    const char *names[2] = {"libusb", "usbfs"};
+    for (int i = 0; i < 2; i++) {
+        UsbAsync usb;
+        if (usb.setBackend(backends[i]) != Usb::USB_SUCCESS) {
+            std::cout<<names[i]<<": unsupported"<<std::endl;
+            continue;
+        }
+        std::atomic<std::size_t> total(0);
+        usb.registerProcess([&total](unsigned char*, std::size_t size) {
+            total += size;
+        });
+        if (usb.start(vendorID, productID) != Usb::USB_SUCCESS) {
+            std::cout<<names[i]<<": fail to open device"<<std::endl;
+            continue;
+        }
+        std::vector<unsigned char> packet(512, 0x5a);
+        for (int j = 0; j < 500; j++) {
+            usb.write(packet);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        usb.stop();
+        UsbAsync::Latency latency = usb.getLatency();
+        std::cout<<names[i]<<": "<<total/5.0/1024/1024<<" MiB/s, latency mean:"
+                <<latency.mean()<<"us, max:"<<latency.max<<"us"<<std::endl;
+    }
+    return;
+}
+
+/* one reader and several writers on the same device, no outside lock */
+void test_concurrent_transfer(unsigned short vendorID, unsigned short productID, int writerNum)
+{
+    Usb usb;
+    if (usb.openDevice(vendorID, productID) != Usb::USB_SUCCESS) {
+        std::cout<<"fail to open device"<<std::endl;
+        return;
+    }
+    std::atomic<std::size_t> sent(0);
+    std::atomic<std::size_t> received(0);
+    std::vector<std::thread> threads;
+    threads.push_back(std::thread([&usb, &received]() {
+        std::vector<unsigned char> buffer(512);
+        for (int i = 0; i < 1000; i++) {
+            std::size_t transferred = 0;
+            usb.recvBulk(buffer.data(), buffer.size(), &transferred);
+            received += transferred;
+        }
+    }));
+    for (int i = 0; i < writerNum; i++) {
+        threads.push_back(std::thread([&usb, &sent]() {
+            std::vector<unsigned char> buffer(512, 0x5a);
+            for (int j = 0; j < 1000; j++) {
+                std::size_t transferred = 0;
+                usb.sendBulk(buffer.data(), buffer.size(), &transferred);
+                sent += transferred;
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::cout<<"sent:"<<sent<<", received:"<<received<<std::endl;
+    return;
+}
+
+/* uhid virtual device: drive Hid end-to-end at a fixed report rate */
+void test_virtual_hid(int backend, unsigned int rate, int seconds)
+{
+    const unsigned short vid = 0x1234;
+    const unsigned short pid = 0x5678;
+    const unsigned short usagePage = 0xff00;
+    const unsigned short usage = 0x0001;
+    VirtualHid device;
+    int ret = device.create("usb virtual hid", vid, pid,
+                            VirtualHid::vendorDescriptor(usagePage, usage));
+    if (ret != VirtualHid::VHID_SUCCESS) {
+        std::cout<<"fail to create virtual hid:"<<ret<<std::endl;
+        return;
+    }
+    /* wait for the kernel to publish the device */
+    bool found = false;
+    for (int i = 0; i < 50 && !found; i++) {
+        std::vector<Hid::Property> devs = Hid::enumerate();
+        for (auto &x : devs) {
+            if (x.vendorID == vid && x.productID == pid && x.usagePage == usagePage && x.usage == usage) {
+                found = true;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    Hid hid;
+    hid.setBackend(backend);
+    hid.registerProcess([&device](unsigned char *data, std::size_t size) {
+        device.check(data, size);
+    });
+    if (hid.start(vid, pid, usagePage, usage) != Hid::HID_SUCCESS) {
+        std::cout<<"fail to open virtual hid"<<std::endl;
+        return;
+    }
+    device.startReports(rate);
+    std::vector<unsigned char> report(VirtualHid::default_report_size, 0x5a);
+    for (int i = 0; i < seconds*10; i++) {
+        hid.write(report.data(), report.size());
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    /* keep reports flowing until a blocking hidapi read has seen the stop */
+    hid.stop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    device.stopReports();
+    VirtualHid::Stats stats = device.getStats();
+    std::cout<<"found:"<<found<<", sent:"<<stats.sent<<", received:"<<stats.received
+            <<", drop rate:"<<stats.dropRate()<<", throughput:"<<stats.bytes/double(seconds)<<"B/s"
+            <<", latency mean:"<<stats.latencyMean()<<"us, max:"<<stats.latencyMax<<"us"
+            <<", outputs:"<<stats.outputs<<std::endl;
+    return;
+}
+
+/* hours of virtual hid reports with hotplug and object churn, plus a loopback
+   usb gadget when vendorID is not 0, until a resource drifts or time is up */
+int test_soak(double hours, unsigned short vendorID, unsigned short productID)
+{
+    const unsigned short vid = 0x1234;
+    const unsigned short pid = 0x5678;
+    const unsigned short usagePage = 0xff00;
+    const unsigned short usage = 0x0001;
+    const unsigned int rate = 1000;
+    Soak soak;
+    VirtualHid device;
+    std::vector<unsigned char> descriptor = VirtualHid::vendorDescriptor(usagePage, usage);
+    if (device.create("usb soak hid", vid, pid, descriptor) != VirtualHid::VHID_SUCCESS) {
+        std::cout<<"fail to create virtual hid"<<std::endl;
+        return Soak::SOAK_INVALID_PARAM;
+    }
+    device.startReports(rate);
+    /* long lived reader, reconnects by itself after every unplug */
+    Hid hid;
+    hid.registerProcess([&device, &soak](unsigned char *data, std::size_t size) {
+        device.check(data, size);
+        soak.recordLatency(VirtualHid::latency(data, size));
+    });
+    hid.start(vid, pid, usagePage, usage);
+    /* hotplug: the device goes away and comes back */
+    soak.addCycle([&]() {
+        device.destroy();
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        if (!soak.running()) {
+            return;
+        }
+        device.create("usb soak hid", vid, pid, descriptor);
+        device.startReports(rate);
+    }, 30000);
+    /* a reader created, started and torn down while reports flow */
+    soak.addCycle([&]() {
+        Hid reader;
+        reader.registerProcess([](unsigned char*, std::size_t) {});
+        reader.start(vid, pid, usagePage, usage);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }, 10000);
+    if (vendorID != 0) {
+        /* streaming reader replaced as a whole, read ring and event thread included */
+        std::shared_ptr<UsbAsync> usbAsync;
+        soak.addCycle([usbAsync, vendorID, productID]() mutable {
+            usbAsync.reset();
+            usbAsync = std::make_shared<UsbAsync>();
+            usbAsync->registerProcess([](unsigned char*, std::size_t) {});
+            usbAsync->start(vendorID, productID);
+        }, 60000);
+        /* synchronous open, timed reads and close against the same device */
+        soak.addCycle([&soak, vendorID, productID]() {
+            Usb usb;
+            if (usb.openDevice(vendorID, productID) != Usb::USB_SUCCESS) {
+                return;
+            }
+            std::vector<unsigned char> buffer(512);
+            for (int i = 0; i < 100 && soak.running(); i++) {
+                std::size_t transferred = 0;
+                long long t0 = ClockSync::now();
+                if (usb.recvBulk(buffer.data(), buffer.size(), &transferred) == Usb::USB_SUCCESS) {
+                    soak.recordLatency((ClockSync::now() - t0)/1000.0);
+                }
+            }
+        }, 5000);
+    }
+    soak.registerSample([](const Soak::Sample &s) {
+        std::cout<<"time:"<<s.time<<"s, rss:"<<s.rss/1024<<"KiB, heap:"<<s.heap/1024
+                <<"KiB, threads:"<<s.threads<<", allocs:"<<s.allocRate<<"/s, reports:"<<s.latencyCount
+                <<", p50:"<<s.p50<<"us, p99:"<<s.p99<<"us, max:"<<s.max<<"us"<<std::endl;
+    });
+    Soak::Threshold threshold;
+    threshold.p99Latency = 20000;
+    int ret = soak.run(int(hours*3600), 300, 60, threshold);
+    hid.stop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    device.stopReports();
+    VirtualHid::Stats stats = device.getStats();
+    std::cout<<"result:"<<ret<<", sent:"<<stats.sent<<", received:"<<stats.received
+            <<", drop rate:"<<stats.dropRate()<<std::endl;
+    return ret;
+}
+
+#ifdef USB_SOAK
+/* usb_soak [hours] [vendorID productID], ids in hex */
+int main(int argc, char *argv[])
+{
+    double hours = argc > 1 ? atof(argv[1]) : 24;
+    unsigned short vendorID = argc > 3 ? strtoul(argv[2], nullptr, 16) : 0;
+    unsigned short productID = argc > 3 ? strtoul(argv[3], nullptr, 16) : 0;
+    return test_soak(hours, vendorID, productID) == Soak::SOAK_SUCCESS ? 0 : 1;
+}
+#else
+/* usb [vendorID productID]           benchmark the backends on a loopback gadget
+   usb snapshot                       dump the device tree
+   usb virtual [backend rate seconds] drive Hid through a uhid device
+   usb concurrent vendorID productID [writers]
+   ids in hex */
+int main(int argc, char *argv[])
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "snapshot") {
+        test_snapshot_device();
+    } else if (mode == "virtual") {
+        int backend = argc > 2 ? atoi(argv[2]) : Hid::BACKEND_HIDRAW;
+        unsigned int rate = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000;
+        int seconds = argc > 4 ? atoi(argv[4]) : 5;
+        test_virtual_hid(backend, rate, seconds);
+    } else if (mode == "concurrent") {
+        if (argc < 4) {
+            std::cout<<"usage: usb concurrent vendorID productID [writers]"<<std::endl;
+            return 1;
+        }
+        int writerNum = argc > 4 ? atoi(argv[4]) : 4;
+        test_concurrent_transfer(strtoul(argv[2], nullptr, 16), strtoul(argv[3], nullptr, 16), writerNum);
+    } else {
+        test_enumerate_usb_device();
+        if (argc > 2) {
+            test_bench_backend(strtoul(argv[1], nullptr, 16), strtoul(argv[2], nullptr, 16));
+        }
+    }
     return 0;
 }
+#endif
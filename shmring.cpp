@@ -0,0 +1,331 @@
+#include "shmring.h"
+#include <cstring>
+#include <thread>
+#include <chrono>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory ring needs lock-free 64 bit atomics");
+
+int ShmRing::map(bool create, std::size_t slotSize, std::size_t slotNum)
+{
+#ifndef _WIN32
+    /* a new segment every time: truncating the old one in place would
+       SIGBUS subscribers that still have it mapped */
+    if (create) {
+        shm_unlink(name.c_str());
+    }
+    fd = shm_open(name.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0666);
+    if (fd < 0) {
+        return SHM_OPEN_FAILED;
+    }
+    if (create) {
+        /* slot headers and payloads stay 8 byte aligned */
+        stride = sizeof(Slot) + ((slotSize + 7) & ~std::size_t(7));
+        mapSize = sizeof(Header) + stride*slotNum;
+        if (ftruncate(fd, mapSize) != 0) {
+            close();
+            return SHM_OPEN_FAILED;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(Header)) {
+            close();
+            return SHM_OPEN_FAILED;
+        }
+        mapSize = st.st_size;
+    }
+    base = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        base = nullptr;
+        close();
+        return SHM_OPEN_FAILED;
+    }
+    header = static_cast<Header*>(base);
+    slots = static_cast<unsigned char*>(base) + sizeof(Header);
+    if (create) {
+        /* the new segment is zeroed, magic goes in last */
+        header->slotSize = slotSize;
+        header->slotNum = slotNum;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = magic_number;
+    } else {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->magic != magic_number) {
+            close();
+            return SHM_OPEN_FAILED;
+        }
+        stride = sizeof(Slot) + ((header->slotSize + 7) & ~std::size_t(7));
+        if (sizeof(Header) + stride*header->slotNum > mapSize) {
+            close();
+            return SHM_OPEN_FAILED;
+        }
+    }
+    return SHM_SUCCESS;
+#else
+    return SHM_UNSUPPORT;
+#endif
+}
+
+ShmRing::Slot* ShmRing::slotAt(std::uint64_t seq) const
+{
+    return reinterpret_cast<Slot*>(slots + (seq % header->slotNum)*stride);
+}
+
+void ShmRing::wake()
+{
+    header->notify.fetch_add(1, std::memory_order_release);
+    if (header->waiters.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&header->notify),
+            FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+    return;
+}
+
+int ShmRing::wait(int timeout)
+{
+    header->waiters.fetch_add(1, std::memory_order_acq_rel);
+    std::uint32_t value = header->notify.load(std::memory_order_acquire);
+    if (header->head.load(std::memory_order_acquire) == cursor) {
+#ifdef __linux__
+        struct timespec ts;
+        ts.tv_sec = timeout/1000;
+        ts.tv_nsec = (timeout%1000)*1000000L;
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&header->notify),
+                FUTEX_WAIT, value, timeout < 0 ? nullptr : &ts, nullptr, 0);
+#else
+        (void)value;
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout < 0 ? 1 : timeout));
+#endif
+    }
+    header->waiters.fetch_sub(1, std::memory_order_acq_rel);
+    return SHM_SUCCESS;
+}
+
+ShmRing::ShmRing():
+    fd(-1),
+    base(nullptr),
+    mapSize(0),
+    header(nullptr),
+    slots(nullptr),
+    stride(0),
+    role(ROLE_NONE),
+    cursorIndex(-1),
+    cursor(0)
+{
+
+}
+
+ShmRing::~ShmRing()
+{
+    close();
+}
+
+int ShmRing::create(const std::string &name_, std::size_t slotSize, std::size_t slotNum)
+{
+    if (role != ROLE_NONE || name_.empty() || slotSize == 0 || slotNum == 0) {
+        return SHM_INVALID_PARAM;
+    }
+    name = name_;
+    int ret = map(true, slotSize, slotNum);
+    if (ret != SHM_SUCCESS) {
+#ifndef _WIN32
+        shm_unlink(name.c_str());
+#endif
+        return ret;
+    }
+    role = ROLE_PUBLISHER;
+    return SHM_SUCCESS;
+}
+
+int ShmRing::publish(const unsigned char *data, std::size_t size)
+{
+    if (role != ROLE_PUBLISHER || data == nullptr) {
+        return SHM_INVALID_PARAM;
+    }
+    std::size_t pos = 0;
+    while (pos < size) {
+        std::size_t len = size - pos;
+        if (len > header->slotSize) {
+            len = header->slotSize;
+        }
+        std::uint64_t n = header->head.load(std::memory_order_relaxed);
+        Slot *slot = slotAt(n);
+        slot->seq.store(2*n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(reinterpret_cast<unsigned char*>(slot + 1), data + pos, len);
+        slot->size = len;
+        slot->seq.store(2*n + 2, std::memory_order_release);
+        header->head.store(n + 1, std::memory_order_release);
+        pos += len;
+    }
+    wake();
+    return SHM_SUCCESS;
+}
+
+ShmRing::FnProcess ShmRing::publisher()
+{
+    return [this](unsigned char *data, std::size_t size) {
+        publish(data, size);
+    };
+}
+
+std::vector<std::uint64_t> ShmRing::subscriberLag() const
+{
+    std::vector<std::uint64_t> lags;
+    if (header == nullptr) {
+        return lags;
+    }
+    std::uint64_t head = header->head.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < max_subscriber_num; i++) {
+        if (header->cursors[i].pid.load(std::memory_order_acquire) == 0) {
+            continue;
+        }
+        lags.push_back(head - header->cursors[i].position.load(std::memory_order_acquire));
+    }
+    return lags;
+}
+
+int ShmRing::open(const std::string &name_)
+{
+    if (role != ROLE_NONE || name_.empty()) {
+        return SHM_INVALID_PARAM;
+    }
+    name = name_;
+    int ret = map(false, 0, 0);
+    if (ret != SHM_SUCCESS) {
+        return ret;
+    }
+#ifndef _WIN32
+    /* claim a cursor, reclaiming the ones left by dead subscribers */
+    std::uint32_t pid = getpid();
+    for (std::size_t i = 0; i < max_subscriber_num && cursorIndex < 0; i++) {
+        Cursor &c = header->cursors[i];
+        std::uint32_t owner = c.pid.load(std::memory_order_acquire);
+        if (owner != 0 && kill(pid_t(owner), 0) == 0) {
+            continue;
+        }
+        if (c.pid.compare_exchange_strong(owner, pid, std::memory_order_acq_rel)) {
+            cursorIndex = int(i);
+        }
+    }
+#endif
+    if (cursorIndex < 0) {
+        close();
+        return SHM_OPEN_FAILED;
+    }
+    copy.resize(header->slotSize);
+    /* start from the newest message */
+    cursor = header->head.load(std::memory_order_acquire);
+    header->cursors[cursorIndex].position.store(cursor, std::memory_order_release);
+    header->cursors[cursorIndex].lost.store(0, std::memory_order_relaxed);
+    role = ROLE_SUBSCRIBER;
+    return SHM_SUCCESS;
+}
+
+int ShmRing::read(const FnProcess &func, int timeout)
+{
+    if (role != ROLE_SUBSCRIBER) {
+        return SHM_INVALID_PARAM;
+    }
+    std::uint64_t head = header->head.load(std::memory_order_acquire);
+    if (head == cursor && timeout != 0) {
+        wait(timeout);
+        head = header->head.load(std::memory_order_acquire);
+    }
+    if (head == cursor) {
+        return SHM_EMPTY;
+    }
+    int ret = SHM_SUCCESS;
+    std::uint64_t lostNum = 0;
+    /* more than a ring behind: skip to the oldest slot still intact */
+    if (head - cursor > header->slotNum) {
+        lostNum += head - header->slotNum - cursor;
+        cursor = head - header->slotNum;
+    }
+    while (cursor < head) {
+        Slot *slot = slotAt(cursor);
+        std::uint64_t expect = 2*cursor + 2;
+        if (slot->seq.load(std::memory_order_acquire) != expect) {
+            lostNum++;
+            cursor++;
+            continue;
+        }
+        std::size_t size = slot->size;
+        if (size > copy.size()) {
+            size = copy.size();
+        }
+        memcpy(copy.data(), reinterpret_cast<unsigned char*>(slot + 1), size);
+        /* the publisher may have lapped us while copying, then the copy is torn */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) != expect) {
+            lostNum++;
+            cursor++;
+            continue;
+        }
+        func(copy.data(), size);
+        cursor++;
+    }
+    Cursor &c = header->cursors[cursorIndex];
+    c.position.store(cursor, std::memory_order_release);
+    if (lostNum > 0) {
+        c.lost.fetch_add(lostNum, std::memory_order_relaxed);
+        ret = SHM_LAGGED;
+    }
+    return ret;
+}
+
+std::uint64_t ShmRing::backlog() const
+{
+    if (header == nullptr) {
+        return 0;
+    }
+    return header->head.load(std::memory_order_acquire) - cursor;
+}
+
+std::uint64_t ShmRing::lost() const
+{
+    if (header == nullptr || cursorIndex < 0) {
+        return 0;
+    }
+    return header->cursors[cursorIndex].lost.load(std::memory_order_relaxed);
+}
+
+void ShmRing::close()
+{
+#ifndef _WIN32
+    if (header != nullptr && cursorIndex >= 0) {
+        header->cursors[cursorIndex].pid.store(0, std::memory_order_release);
+    }
+    if (base != nullptr) {
+        munmap(base, mapSize);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (role == ROLE_PUBLISHER) {
+        shm_unlink(name.c_str());
+    }
+#endif
+    fd = -1;
+    base = nullptr;
+    header = nullptr;
+    slots = nullptr;
+    cursorIndex = -1;
+    role = ROLE_NONE;
+    return;
+}
@@ -0,0 +1,103 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+/* single publisher, many subscriber ring in posix shared memory
+   the process owning the device publishes every received buffer, other
+   processes read the slots with their own cursor */
+class ShmRing
+{
+public:
+    enum Code {
+        SHM_SUCCESS = 0,
+        SHM_INVALID_PARAM,
+        SHM_OPEN_FAILED,
+        SHM_EMPTY,
+        SHM_LAGGED,
+        SHM_UNSUPPORT
+    };
+    enum Role {
+        ROLE_NONE = 0,
+        ROLE_PUBLISHER,
+        ROLE_SUBSCRIBER
+    };
+    using FnProcess = std::function<void(unsigned char*, std::size_t)>;
+    constexpr static std::uint32_t magic_number = 0x55534252;
+    constexpr static std::size_t max_subscriber_num = 32;
+    constexpr static std::size_t default_slot_size = 1024;
+    constexpr static std::size_t default_slot_num = 1024;
+
+    struct Cursor
+    {
+        /* owner pid, 0 when free */
+        std::atomic<std::uint32_t> pid;
+        std::atomic<std::uint64_t> position;
+        std::atomic<std::uint64_t> lost;
+    };
+
+    struct Header
+    {
+        std::uint32_t magic;
+        std::uint32_t slotSize;
+        std::uint32_t slotNum;
+        /* futex word bumped on every publish, waiters tells if a wake is needed */
+        std::atomic<std::uint32_t> notify;
+        std::atomic<std::uint32_t> waiters;
+        /* sequence of the next message */
+        std::atomic<std::uint64_t> head;
+        Cursor cursors[max_subscriber_num];
+    };
+
+    struct Slot
+    {
+        /* 2*seq+1 while being written, 2*seq+2 once complete */
+        std::atomic<std::uint64_t> seq;
+        std::uint32_t size;
+        std::uint32_t reserved;
+    };
+protected:
+    std::string name;
+    int fd;
+    void *base;
+    std::size_t mapSize;
+    Header *header;
+    unsigned char *slots;
+    std::size_t stride;
+    int role;
+    int cursorIndex;
+    std::uint64_t cursor;
+    /* subscriber: a slot is copied out and checked before func sees it */
+    std::vector<unsigned char> copy;
+protected:
+    int map(bool create, std::size_t slotSize, std::size_t slotNum);
+    Slot* slotAt(std::uint64_t seq) const;
+    void wake();
+    int wait(int timeout);
+public:
+    ShmRing();
+    ~ShmRing();
+    /* publisher */
+    int create(const std::string &name_,
+               std::size_t slotSize = default_slot_size,
+               std::size_t slotNum = default_slot_num);
+    /* buffers longer than a slot are split across consecutive slots */
+    int publish(const unsigned char *data, std::size_t size);
+    /* adapter for UsbAsync::registerProcess and Hid::registerProcess */
+    FnProcess publisher();
+    std::vector<std::uint64_t> subscriberLag() const;
+    /* subscriber */
+    int open(const std::string &name_);
+    /* hands a checked copy of every available slot to func, waits up to
+       timeout ms when nothing is there; SHM_LAGGED when the publisher
+       overran us, overwritten slots are counted lost and never delivered */
+    int read(const FnProcess &func, int timeout = 0);
+    std::uint64_t backlog() const;
+    std::uint64_t lost() const;
+    void close();
+};
+
+#endif // SHMRING_H
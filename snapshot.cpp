@@ -0,0 +1,139 @@
+#include "snapshot.h"
+#include <atomic>
+#include <thread>
+#include "hid.h"
+
+void Snapshot::read(libusb_device *dev, Snapshot::Device &device, bool readSerial)
+{
+    /* endpoints */
+    libusb_config_descriptor *configDesc = nullptr;
+    if (libusb_get_active_config_descriptor(dev, &configDesc) == LIBUSB_SUCCESS ||
+            libusb_get_config_descriptor(dev, 0, &configDesc) == LIBUSB_SUCCESS) {
+        for (int i = 0; i < configDesc->bNumInterfaces; i++) {
+            const libusb_interface &iface = configDesc->interface[i];
+            if (iface.num_altsetting <= 0) {
+                continue;
+            }
+            /* the default alternate setting is the one in use */
+            const libusb_interface_descriptor &altsetting = iface.altsetting[0];
+            for (int k = 0; k < altsetting.bNumEndpoints; k++) {
+                if (device.endpointNum >= max_endpoint_num) {
+                    break;
+                }
+                const libusb_endpoint_descriptor &endpoint = altsetting.endpoint[k];
+                Endpoint &ep = device.endpoints[device.endpointNum++];
+                ep.address = endpoint.bEndpointAddress;
+                ep.attributes = endpoint.bmAttributes;
+                ep.maxPacketSize = endpoint.wMaxPacketSize & 0x7ff;
+            }
+        }
+        libusb_free_config_descriptor(configDesc);
+    }
+    /* serial, the only read that needs the device opened */
+    if (readSerial) {
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS && desc.iSerialNumber != 0) {
+            libusb_device_handle *handle = nullptr;
+            if (libusb_open(dev, &handle) == LIBUSB_SUCCESS) {
+                int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                                             (unsigned char*)device.serial,
+                                                             max_serial_size - 1);
+                device.serial[len > 0 ? len : 0] = '\0';
+                libusb_close(handle);
+            }
+        }
+    }
+    return;
+}
+
+void Snapshot::matchHid(std::vector<Snapshot::Device> &devices)
+{
+    Hid::initialize();
+    struct hid_device_info *devs = hid_enumerate(0x0, 0x0);
+    for (struct hid_device_info *cur = devs; cur != nullptr; cur = cur->next) {
+        char serial[max_serial_size] = {0};
+        if (cur->serial_number != nullptr) {
+            for (std::size_t i = 0; i < max_serial_size - 1 && cur->serial_number[i] != 0; i++) {
+                serial[i] = char(cur->serial_number[i]);
+            }
+        }
+        for (std::size_t i = 0; i < devices.size(); i++) {
+            Device &device = devices[i];
+            if (device.usagePage != 0 ||
+                    device.vendorID != cur->vendor_id ||
+                    device.productID != cur->product_id) {
+                continue;
+            }
+            if (serial[0] != '\0' && device.serial[0] != '\0' && strcmp(serial, device.serial) != 0) {
+                continue;
+            }
+            device.usagePage = cur->usage_page;
+            device.usage = cur->usage;
+            break;
+        }
+    }
+    hid_free_enumeration(devs);
+    return;
+}
+
+std::vector<Snapshot::Device> Snapshot::take(const Snapshot::FnFilter &filter,
+                                             std::size_t workerNum,
+                                             bool readSerial,
+                                             bool readHid)
+{
+    std::vector<Device> devices;
+    libusb_device **devs = nullptr;
+    ssize_t deviceNum = libusb_get_device_list(Usb::getContext(), &devs);
+    if (deviceNum < 0) {
+        return devices;
+    }
+    /* the cheap pass: device descriptors are cached by libusb */
+    std::vector<libusb_device*> selected;
+    for (ssize_t i = 0; i < deviceNum; i++) {
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS) {
+            continue;
+        }
+        if (filter && !filter(desc)) {
+            continue;
+        }
+        Device device;
+        memset(&device, 0, sizeof(Device));
+        device.bus = libusb_get_bus_number(devs[i]);
+        device.address = libusb_get_device_address(devs[i]);
+        int portNum = libusb_get_port_numbers(devs[i], device.portPath, max_port_num);
+        device.portNum = portNum > 0 ? portNum : 0;
+        device.speed = libusb_get_device_speed(devs[i]);
+        device.vendorID = desc.idVendor;
+        device.productID = desc.idProduct;
+        device.deviceClass = desc.bDeviceClass;
+        devices.push_back(device);
+        selected.push_back(devs[i]);
+    }
+    /* the expensive pass across a worker pool */
+    if (workerNum == 0) {
+        workerNum = std::thread::hardware_concurrency();
+    }
+    if (workerNum > selected.size()) {
+        workerNum = selected.size();
+    }
+    std::atomic<std::size_t> next(0);
+    auto work = [&]() {
+        for (std::size_t i = next++; i < selected.size(); i = next++) {
+            read(selected[i], devices[i], readSerial);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < workerNum; i++) {
+        workers.push_back(std::thread(work));
+    }
+    work();
+    for (std::size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    libusb_free_device_list(devs, 1);
+    if (readHid) {
+        matchHid(devices);
+    }
+    return devices;
+}
@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <vector>
+#include <functional>
+#include "usb.h"
+
+/* flat inventory of every attached device, descriptors read in parallel */
+class Snapshot
+{
+public:
+    constexpr static std::size_t max_port_num = 7;
+    constexpr static std::size_t max_endpoint_num = 16;
+    constexpr static std::size_t max_serial_size = 64;
+
+    struct Endpoint
+    {
+        unsigned char address;
+        unsigned char attributes;
+        unsigned short maxPacketSize;
+    };
+
+    struct Device
+    {
+        unsigned char bus;
+        unsigned char address;
+        unsigned char portNum;
+        unsigned char portPath[max_port_num];
+        int speed;
+        unsigned short vendorID;
+        unsigned short productID;
+        unsigned char deviceClass;
+        char serial[max_serial_size];
+        unsigned char endpointNum;
+        Endpoint endpoints[max_endpoint_num];
+        /* hid usage of the first matching hid interface, 0 otherwise */
+        unsigned short usagePage;
+        unsigned short usage;
+    };
+    /* runs on the cached device descriptor, before anything is read */
+    using FnFilter = std::function<bool(const libusb_device_descriptor&)>;
+protected:
+    static void read(libusb_device *dev, Device &device, bool readSerial);
+    static void matchHid(std::vector<Device> &devices);
+public:
+    /* workerNum 0 uses one worker per hardware thread */
+    static std::vector<Device> take(const FnFilter &filter = FnFilter(),
+                                    std::size_t workerNum = 0,
+                                    bool readSerial = true,
+                                    bool readHid = true);
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,313 @@
+#include "soak.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <new>
+#ifdef __linux__
+#include <unistd.h>
+#include <malloc.h>
+#endif
+
+#ifdef SOAK_COUNT_ALLOC
+/* global replacement, only in soak builds: every new goes through here */
+static std::atomic<std::uint64_t> g_allocCount(0);
+
+void* operator new(std::size_t size)
+{
+    g_allocCount.fetch_add(1, std::memory_order_relaxed);
+    void *ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+#endif
+
+void Soak::churn(std::size_t index)
+{
+    Cycle &cycle = cycles[index];
+    auto next = std::chrono::steady_clock::now();
+    while (isRunning.load()) {
+        {
+            std::unique_lock<std::mutex> locker(churnMutex);
+            churnCondit.wait(locker, [this]()->bool{
+                                 return !isPaused || !isRunning.load();
+                             });
+            /* the run may have ended while sampling held the cycle back */
+            if (!isRunning.load()) {
+                break;
+            }
+            activeCycles++;
+        }
+        cycle.func();
+        {
+            std::lock_guard<std::mutex> guard(churnMutex);
+            activeCycles--;
+        }
+        churnCondit.notify_all();
+        next += std::chrono::milliseconds(cycle.period);
+        /* short sleeps so the end of the run is not held up */
+        while (isRunning.load() && std::chrono::steady_clock::now() < next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+    return;
+}
+
+void Soak::pauseChurn()
+{
+    std::unique_lock<std::mutex> locker(churnMutex);
+    isPaused = true;
+    churnCondit.wait(locker, [this]()->bool{
+                         return activeCycles == 0;
+                     });
+    return;
+}
+
+void Soak::resumeChurn()
+{
+    {
+        std::lock_guard<std::mutex> guard(churnMutex);
+        isPaused = false;
+    }
+    churnCondit.notify_all();
+    return;
+}
+
+int Soak::check(const Soak::Sample &baseline, const Soak::Sample &s, const Soak::Threshold &threshold)
+{
+    if (threshold.rssGrowth > 0 && s.rss > baseline.rss + threshold.rssGrowth) {
+        return SOAK_RSS_DRIFT;
+    }
+    if (threshold.heapGrowth > 0 && s.heap > baseline.heap + threshold.heapGrowth) {
+        return SOAK_HEAP_DRIFT;
+    }
+    if (threshold.threadGrowth > 0 && s.threads > baseline.threads + threshold.threadGrowth) {
+        return SOAK_THREAD_DRIFT;
+    }
+    if (threshold.allocGrowth > 0 && s.allocRate > baseline.allocRate + threshold.allocGrowth) {
+        return SOAK_ALLOC_DRIFT;
+    }
+    if (threshold.p99Latency > 0 && s.p99 > threshold.p99Latency) {
+        return SOAK_LATENCY_DRIFT;
+    }
+    return SOAK_SUCCESS;
+}
+
+double Soak::bucketValue(std::size_t index)
+{
+    return std::pow(2.0, double(index)/bucket_per_octave);
+}
+
+Soak::Sample Soak::sample(double time, double elapsed, std::uint64_t &allocs)
+{
+    Sample s;
+    s.time = time;
+    s.rss = rss();
+    s.heap = heap();
+    s.threads = threadCount();
+    std::uint64_t count = allocCount();
+    s.allocRate = elapsed > 0 ? double(count - allocs)/elapsed : 0;
+    allocs = count;
+    /* percentiles of this interval only, the histogram starts over */
+    std::uint64_t counts[max_bucket_num];
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < max_bucket_num; i++) {
+        counts[i] = buckets[i].exchange(0);
+        total += counts[i];
+    }
+    s.latencyCount = total;
+    s.p50 = 0;
+    s.p99 = 0;
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < max_bucket_num && total > 0; i++) {
+        seen += counts[i];
+        if (s.p50 == 0 && seen*100 >= total*50) {
+            s.p50 = bucketValue(i + 1);
+        }
+        if (seen*100 >= total*99) {
+            s.p99 = bucketValue(i + 1);
+            break;
+        }
+    }
+    s.max = double(latencyMax.exchange(0))/1000.0;
+    return s;
+}
+
+Soak::Soak():
+    isRunning(false),
+    isPaused(false),
+    activeCycles(0),
+    latencyMax(0)
+{
+    for (std::size_t i = 0; i < max_bucket_num; i++) {
+        buckets[i] = 0;
+    }
+    sampleNotify = [](const Sample&){};
+}
+
+Soak::~Soak()
+{
+    isRunning = false;
+    for (std::size_t i = 0; i < threads.size(); i++) {
+        if (threads[i].joinable()) {
+            threads[i].join();
+        }
+    }
+}
+
+void Soak::addCycle(const Soak::FnCycle &func, int period)
+{
+    if (isRunning.load() || period <= 0) {
+        return;
+    }
+    Cycle cycle;
+    cycle.func = func;
+    cycle.period = period;
+    cycles.push_back(cycle);
+    return;
+}
+
+void Soak::recordLatency(double us)
+{
+    std::size_t index = 0;
+    if (us > 1) {
+        index = std::size_t(std::log2(us)*bucket_per_octave);
+        if (index >= max_bucket_num) {
+            index = max_bucket_num - 1;
+        }
+    }
+    buckets[index].fetch_add(1, std::memory_order_relaxed);
+    /* max kept in ns to stay integral */
+    std::uint64_t ns = std::uint64_t(us*1000);
+    std::uint64_t current = latencyMax.load(std::memory_order_relaxed);
+    while (ns > current && !latencyMax.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {
+    }
+    return;
+}
+
+int Soak::run(int duration, int settle, int interval, const Soak::Threshold &threshold)
+{
+    if (duration <= 0 || interval <= 0 || isRunning.load()) {
+        return SOAK_INVALID_PARAM;
+    }
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        samples.clear();
+    }
+    isRunning = true;
+    for (std::size_t i = 0; i < cycles.size(); i++) {
+        threads.push_back(std::thread(&Soak::churn, this, i));
+    }
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point t0 = Clock::now();
+    Clock::time_point last = t0;
+    std::uint64_t allocs = allocCount();
+    bool hasBaseline = false;
+    Sample baseline;
+    int ret = SOAK_SUCCESS;
+    bool isLast = false;
+    while (ret == SOAK_SUCCESS && !isLast) {
+        std::this_thread::sleep_for(std::chrono::seconds(interval));
+        /* sample between churn steps, not in the middle of one */
+        pauseChurn();
+        Clock::time_point now = Clock::now();
+        double time = std::chrono::duration<double>(now - t0).count();
+        Sample s = sample(time, std::chrono::duration<double>(now - last).count(), allocs);
+        resumeChurn();
+        last = now;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            samples.push_back(s);
+        }
+        sampleNotify(s);
+        /* the final sample is gated like every other */
+        isLast = time >= duration;
+        if (time < settle) {
+            continue;
+        }
+        if (!hasBaseline) {
+            baseline = s;
+            hasBaseline = true;
+            continue;
+        }
+        ret = check(baseline, s, threshold);
+    }
+    isRunning = false;
+    resumeChurn();
+    for (std::size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    threads.clear();
+    return ret;
+}
+
+std::vector<Soak::Sample> Soak::getSamples()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return samples;
+}
+
+std::size_t Soak::rss()
+{
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    int n = fscanf(file, "%lu %lu", &size, &resident);
+    fclose(file);
+    return n == 2 ? std::size_t(resident)*std::size_t(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+std::size_t Soak::heap()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks;
+#else
+    return 0;
+#endif
+}
+
+int Soak::threadCount()
+{
+#ifdef __linux__
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    int count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (sscanf(line, "Threads: %d", &count) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return count;
+#else
+    return 0;
+#endif
+}
+
+std::uint64_t Soak::allocCount()
+{
+#ifdef SOAK_COUNT_ALLOC
+    return g_allocCount.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
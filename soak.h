@@ -0,0 +1,108 @@
+#ifndef SOAK_H
+#define SOAK_H
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+
+/* long running stress loop: runs churn steps (hotplug, reopen) on their own
+   threads while sampling rss, heap, allocations, thread count and latency
+   percentiles, and stops as soon as one of them drifts past its threshold
+   relative to the baseline taken after the settle time. Churn is held back
+   while a sample is taken, so no sample lands inside a hotplug gap or the
+   lifetime of a short lived object */
+class Soak
+{
+public:
+    enum Code {
+        SOAK_SUCCESS = 0,
+        SOAK_INVALID_PARAM,
+        SOAK_RSS_DRIFT,
+        SOAK_HEAP_DRIFT,
+        SOAK_THREAD_DRIFT,
+        SOAK_ALLOC_DRIFT,
+        SOAK_LATENCY_DRIFT
+    };
+    /* 0 disables a check */
+    struct Threshold
+    {
+        /* growth over the baseline in bytes */
+        std::size_t rssGrowth;
+        std::size_t heapGrowth;
+        int threadGrowth;
+        /* allocations per second, needs SOAK_COUNT_ALLOC. Counts operator new
+           only, malloc from libusb and hidapi shows up in rss and heap instead */
+        double allocGrowth;
+        /* 99th percentile in microseconds */
+        double p99Latency;
+        Threshold():rssGrowth(64*1024*1024), heapGrowth(32*1024*1024), threadGrowth(2),
+            allocGrowth(1000), p99Latency(0){}
+    };
+    struct Sample
+    {
+        /* seconds since run started */
+        double time;
+        std::size_t rss;
+        std::size_t heap;
+        int threads;
+        double allocRate;
+        std::uint64_t latencyCount;
+        double p50;
+        double p99;
+        double max;
+    };
+    using FnCycle = std::function<void(void)>;
+    using FnSample = std::function<void(const Sample&)>;
+    /* latency histogram, 8 buckets per power of two from 1us */
+    constexpr static int bucket_per_octave = 8;
+    constexpr static std::size_t max_bucket_num = 8*32;
+protected:
+    struct Cycle
+    {
+        FnCycle func;
+        int period;
+    };
+    std::vector<Cycle> cycles;
+    std::vector<std::thread> threads;
+    std::atomic_bool isRunning;
+    /* sampling waits for the churn steps in progress and holds new ones back */
+    std::mutex churnMutex;
+    std::condition_variable churnCondit;
+    bool isPaused;
+    int activeCycles;
+    std::atomic<std::uint64_t> buckets[max_bucket_num];
+    std::atomic<std::uint64_t> latencyMax;
+    std::mutex mutex;
+    std::vector<Sample> samples;
+    FnSample sampleNotify;
+protected:
+    void churn(std::size_t index);
+    void pauseChurn();
+    void resumeChurn();
+    static int check(const Sample &baseline, const Sample &s, const Threshold &threshold);
+    Sample sample(double time, double elapsed, std::uint64_t &allocs);
+    static double bucketValue(std::size_t index);
+public:
+    Soak();
+    ~Soak();
+    /* func runs every period ms for the whole run */
+    void addCycle(const FnCycle &func, int period);
+    void registerSample(const FnSample &func) {sampleNotify = func;}
+    /* cycles with several steps test it between them, so stopping waits for one step only */
+    bool running() const {return isRunning.load();}
+    /* lock-free, safe from any receive callback */
+    void recordLatency(double us);
+    /* blocks for duration seconds, the first settle seconds set the baseline */
+    int run(int duration, int settle = 60, int interval = 10, const Threshold &threshold = Threshold());
+    std::vector<Sample> getSamples();
+    static std::size_t rss();
+    static std::size_t heap();
+    static int threadCount();
+    /* 0 unless built with SOAK_COUNT_ALLOC */
+    static std::uint64_t allocCount();
+};
+
+#endif // SOAK_H
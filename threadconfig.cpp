@@ -0,0 +1,140 @@
+#include "threadconfig.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+bool ThreadConfig::isDefault() const
+{
+    return cpus.empty() && priority == default_priority && numaNode == any_node;
+}
+
+int ThreadConfig::apply() const
+{
+    int ret = THREAD_SUCCESS;
+#ifdef __linux__
+    if (!cpus.empty()) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (std::size_t i = 0; i < cpus.size(); i++) {
+            if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+                ret = THREAD_AFFINITY_FAILED;
+                continue;
+            }
+            CPU_SET(cpus[i], &cpuset);
+        }
+        if (CPU_COUNT(&cpuset) == 0 ||
+                pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+            ret = THREAD_AFFINITY_FAILED;
+        }
+    }
+    if (priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+            ret = THREAD_PRIORITY_FAILED;
+        }
+    }
+#elif defined(_WIN32)
+    if (!cpus.empty()) {
+        DWORD_PTR mask = 0;
+        for (std::size_t i = 0; i < cpus.size(); i++) {
+            if (cpus[i] < 0 || cpus[i] >= int(sizeof(DWORD_PTR)*8)) {
+                ret = THREAD_AFFINITY_FAILED;
+                continue;
+            }
+            mask |= DWORD_PTR(1) << cpus[i];
+        }
+        if (mask == 0 || SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+            ret = THREAD_AFFINITY_FAILED;
+        }
+    }
+    if (priority > 0) {
+        if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+            ret = THREAD_PRIORITY_FAILED;
+        }
+    }
+#else
+    if (!isDefault()) {
+        ret = THREAD_UNSUPPORT;
+    }
+#endif
+    return ret;
+}
+
+int ThreadConfig::node() const
+{
+    if (numaNode != any_node) {
+        return numaNode;
+    }
+    if (cpus.empty()) {
+        return any_node;
+    }
+    return nodeOfCpu(cpus[0]);
+}
+
+void* ThreadConfig::allocate(std::size_t size) const
+{
+    if (size == 0) {
+        return nullptr;
+    }
+#ifdef __linux__
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return nullptr;
+    }
+    int n = node();
+    if (n >= 0 && n < int(sizeof(unsigned long) * 8)) {
+        /* MPOL_PREFERRED, falls back to other nodes when the local one is full */
+        const int mpol_preferred = 1;
+        unsigned long nodemask = 1UL << n;
+        syscall(SYS_mbind, ptr, size, mpol_preferred, &nodemask, sizeof(nodemask) * 8, 0);
+    }
+    /* first touch from the calling thread faults the pages in locally */
+    memset(ptr, 0, size);
+    return ptr;
+#else
+    void *ptr = std::malloc(size);
+    if (ptr != nullptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+#endif
+}
+
+void ThreadConfig::release(void *ptr, std::size_t size) const
+{
+    if (ptr == nullptr) {
+        return;
+    }
+#ifdef __linux__
+    munmap(ptr, size);
+#else
+    std::free(ptr);
+#endif
+    return;
+}
+
+int ThreadConfig::nodeOfCpu(int cpu)
+{
+#ifdef __linux__
+    /* the cpu directory holds a nodeN link for its numa node */
+    for (int n = 0; n < 64; n++) {
+        std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+                "/node" + std::to_string(n);
+        if (access(path.c_str(), F_OK) == 0) {
+            return n;
+        }
+    }
+#endif
+    return any_node;
+}
@@ -0,0 +1,39 @@
+#ifndef THREADCONFIG_H
+#define THREADCONFIG_H
+#include <cstddef>
+#include <vector>
+
+class ThreadConfig
+{
+public:
+    enum Code {
+        THREAD_SUCCESS = 0,
+        THREAD_AFFINITY_FAILED,
+        THREAD_PRIORITY_FAILED,
+        THREAD_UNSUPPORT
+    };
+    constexpr static int default_priority = 0;
+    constexpr static int any_node = -1;
+public:
+    /* cpus the thread may run on, empty means no pinning */
+    std::vector<int> cpus;
+    /* SCHED_FIFO priority, 0 keeps the default policy */
+    int priority;
+    /* numa node for buffers, any_node follows the first pinned cpu */
+    int numaNode;
+public:
+    ThreadConfig():priority(default_priority), numaNode(any_node){}
+    explicit ThreadConfig(int cpu, int priority_ = default_priority):
+        cpus(1, cpu), priority(priority_), numaNode(any_node){}
+    bool isDefault() const;
+    /* apply to the calling thread, THREAD_AFFINITY_FAILED also for a cpu
+       index out of range. SCHED_FIFO needs CAP_SYS_NICE or an rtprio limit */
+    int apply() const;
+    /* buffer memory on the local numa node */
+    int node() const;
+    void* allocate(std::size_t size) const;
+    void release(void *ptr, std::size_t size) const;
+    static int nodeOfCpu(int cpu);
+};
+
+#endif // THREADCONFIG_H
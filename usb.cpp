@@ -2,13 +2,16 @@
 
 Usb::Context Usb::context;
 
+/* set on every thread running libusb events for any Usb, they share one context */
+static thread_local bool g_isEventThread = false;
+
 int Usb::attach(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *userdata)
 {
     if (userdata == nullptr) {
         return -1;
     }
     Usb *usb = static_cast<Usb*>(userdata);
-    usb->_openDevice();
+    usb->onAttach();
     return 0;
 }
 
@@ -18,12 +21,33 @@ int Usb::detach(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event ev
         return -1;
     }
     Usb *usb = static_cast<Usb*>(userdata);
-    usb->closeDevice();
+    usb->onDetach();
     return 0;
 }
 
+void Usb::onAttach()
+{
+    _openDevice();
+    return;
+}
+
+void Usb::onDetach()
+{
+    closeDevice();
+    return;
+}
+
 void Usb::handleEvent()
 {
+    g_isEventThread = true;
+    eventThreadStatus = eventThreadConfig.apply();
+    if (eventThreadStatus.load() != ThreadConfig::THREAD_SUCCESS) {
+        LOG_INFO("fail to apply event thread config", LIBUSB_ERROR_OTHER);
+    }
+    if (eventMode.load() == EVENT_BUSY_POLL) {
+        pollEvent();
+        return;
+    }
     while (isHandleEvent.load()) {
         struct timeval val;
         val.tv_sec = 3;
@@ -34,11 +58,49 @@ void Usb::handleEvent()
     return;
 }
 
+void Usb::pollEvent()
+{
+    libusb_context *ctx = Usb::context.get();
+    struct timeval zero;
+    zero.tv_sec = 0;
+    zero.tv_usec = 0;
+    unsigned long lastCount = eventCount.load();
+    int idleCount = 0;
+    int sleepDuration = 1;
+    while (isHandleEvent.load()) {
+        libusb_handle_events_timeout_completed(ctx, &zero, nullptr);
+        unsigned long count = eventCount.load(std::memory_order_relaxed);
+        if (count != lastCount) {
+            lastCount = count;
+            idleCount = 0;
+            sleepDuration = 1;
+            continue;
+        }
+        if (idleCount < busy_poll_spin_count) {
+            idleCount++;
+            continue;
+        }
+        /* idle: back off to sleeping until transfers complete again */
+        std::this_thread::sleep_for(std::chrono::microseconds(sleepDuration));
+        if (sleepDuration < busy_poll_max_sleep_us) {
+            sleepDuration *= 2;
+        }
+    }
+    return;
+}
+
 Usb::Usb():
-    handle(nullptr),
     interfaceNum(1),
+    backend(BACKEND_LIBUSB),
+    attachHandler(0),
+    detachHandler(0),
+    hasAttachHandler(false),
+    hasDetachHandler(false),
     isHandleEvent(false),
-    eventThread(nullptr)
+    eventThread(nullptr),
+    eventThreadStatus(ThreadConfig::THREAD_SUCCESS),
+    eventMode(EVENT_BLOCK),
+    eventCount(0)
 {
     attachNotify = [](){};
     detachNotify = [](){};
@@ -46,9 +108,15 @@ Usb::Usb():
 
 Usb::~Usb()
 {
+    deregisterHotplug();
     stopHandleEvent();
 }
 
+bool Usb::isEventThread()
+{
+    return g_isEventThread;
+}
+
 int Usb::findEndpoint(libusb_device *dev, unsigned char &inEndpoint, unsigned char &outEndpoint)
 {
     libusb_config_descriptor *configDesc = nullptr;
@@ -96,7 +164,7 @@ std::vector<Usb::Property> Usb::enumerate()
         }
         Usb::Property device;
         device.vendorID = desc.idVendor;
-        device.productID = desc.iProduct;
+        device.productID = desc.idProduct;
         Usb::findEndpoint(dev, device.inEndpoint, device.outEndpoint);
 		devices.push_back(device);
     }
@@ -155,37 +223,71 @@ int Usb::openDevice(unsigned short vendorID, unsigned short productID)
     return _openDevice();
 }
 
-int Usb::_openDevice()
+Usb::Device::~Device()
 {
-    if (handle != nullptr) {
-        return USB_SUCCESS;
-    }
-    if (context.get() == nullptr) {
-        return USB_INVALID_CONTEXT;
+    if (handle == nullptr) {
+        return;
     }
-    int ret = findDevice(property.vendorID,
-                         property.productID,
-                         handle,
-                         property.inEndpoint,
-                         property.outEndpoint);
-    if (ret != LIBUSB_SUCCESS) {
-        return USB_OPEN_FAILED;
+    if (backend == BACKEND_USBFS) {
+        usbfs.close();
+    } else if (isClaimed) {
+        libusb_release_interface(handle, interfaceNum);
     }
-    /* kernel driver */
-    ret = libusb_detach_kernel_driver(handle, interfaceNum);
-    if (ret != LIBUSB_SUCCESS) {
+    libusb_close(handle);
+}
 
-    }
-    /* claim interface */
-    ret = libusb_claim_interface(handle, interfaceNum);
-    if (ret != LIBUSB_SUCCESS) {
-        LOG_INFO("fail to claim interface", ret);
-    }
+int Usb::_openDevice()
+{
+    {
+        std::lock_guard<std::mutex> guard(deviceMutex);
+        if (acquire() != nullptr) {
+            return USB_SUCCESS;
+        }
+        if (context.get() == nullptr) {
+            return USB_INVALID_CONTEXT;
+        }
+        DevicePtr dev(new Device);
+        dev->interfaceNum = interfaceNum;
+        dev->backend = backend;
+        int ret = findDevice(property.vendorID,
+                             property.productID,
+                             dev->handle,
+                             dev->inEndpoint,
+                             dev->outEndpoint);
+        if (ret != LIBUSB_SUCCESS) {
+            return USB_OPEN_FAILED;
+        }
+        if (backend == BACKEND_USBFS) {
+            /* libusb keeps the handle for control transfers, usbfs owns the interface */
+            libusb_device *usbDev = libusb_get_device(dev->handle);
+            ret = dev->usbfs.open(libusb_get_bus_number(usbDev), libusb_get_device_address(usbDev));
+            if (ret == LIBUSB_SUCCESS) {
+                ret = dev->usbfs.claim(interfaceNum);
+            }
+            if (ret != LIBUSB_SUCCESS) {
+                LOG_INFO("fail to open usbfs", ret);
+                return USB_OPEN_FAILED;
+            }
+        } else {
+            /* kernel driver */
+            ret = libusb_detach_kernel_driver(dev->handle, interfaceNum);
+            if (ret != LIBUSB_SUCCESS) {
 
-    /* set config */
-    ret = libusb_set_configuration(handle, 1);
-    if (ret != LIBUSB_SUCCESS) {
-        LOG_INFO("fail to set configuration", ret);
+            }
+            /* claim interface */
+            ret = libusb_claim_interface(dev->handle, interfaceNum);
+            if (ret != LIBUSB_SUCCESS) {
+                LOG_INFO("fail to claim interface", ret);
+            }
+            dev->isClaimed = ret == LIBUSB_SUCCESS;
+
+            /* set config */
+            ret = libusb_set_configuration(dev->handle, 1);
+            if (ret != LIBUSB_SUCCESS) {
+                LOG_INFO("fail to set configuration", ret);
+            }
+        }
+        std::atomic_store(&device, dev);
     }
     /* notify */
     attachNotify();
@@ -194,156 +296,135 @@ int Usb::_openDevice()
 
 void Usb::closeDevice()
 {
-    if (handle != nullptr) {
-        libusb_release_interface(handle, interfaceNum);
-        libusb_close(handle);
-        handle = nullptr;
+    DevicePtr dev;
+    {
+        std::lock_guard<std::mutex> guard(deviceMutex);
+        dev = std::atomic_exchange(&device, DevicePtr());
+    }
+    if (dev != nullptr) {
+        /* transfers still running keep the device open until they return */
+        dev.reset();
         /* notify */
         detachNotify();
     }
     return;
 }
 
-int Usb::sendBulk(unsigned char *data, size_t size)
+unsigned char Usb::endpoint(int direction) const
 {
-    if (handle == nullptr) {
-        return USB_INVALID_PARAM;
+    DevicePtr dev = acquire();
+    if (dev == nullptr) {
+        return 0;
     }
-    int ret = 0;
-    for (int i = 0; i < max_retry_count; i++) {
-        int actualSize = 0;
-        ret = libusb_bulk_transfer(handle,
-                                   property.outEndpoint,
-                                   data,
-                                   size,
-                                   &actualSize,
-                                   timeout_duration);
-        if (ret == LIBUSB_ERROR_PIPE) {
-            continue;
-        } else {
-            break;
-        }
-    }
-    if (ret != LIBUSB_SUCCESS) {
-        return USB_TRANSFER_ERROR;
-    }
-    return USB_SUCCESS;
+    return direction == LIBUSB_ENDPOINT_IN ? dev->inEndpoint : dev->outEndpoint;
 }
 
-int Usb::recvBulk(unsigned char *data, size_t size)
+int Usb::sendBulk(unsigned char *data, size_t size, size_t *transferred)
 {
-    if (handle == nullptr) {
-        return USB_INVALID_PARAM;
-    }
-    int ret = 0;
-    for (int i = 0; i < max_retry_count; i++) {
-        int actualSize = 0;
-        ret = libusb_bulk_transfer(handle,
-                                   property.inEndpoint,
-                                   data,
-                                   size,
-                                   &actualSize,
-                                   timeout_duration);
-        if (ret == LIBUSB_ERROR_PIPE) {
-            continue;
-        } else {
-            break;
-        }
-    }
-    if (ret != LIBUSB_SUCCESS) {
-        return USB_TRANSFER_ERROR;
-    }
-    return USB_SUCCESS;
+    return sendBulk(data, size, getPolicy(endpoint(LIBUSB_ENDPOINT_OUT)), transferred);
 }
 
-int Usb::sendInterrupt(unsigned char *data, size_t size)
+int Usb::recvBulk(unsigned char *data, size_t size, size_t *transferred)
 {
-    if (handle == nullptr) {
-        return USB_INVALID_PARAM;
-    }
-    int ret = 0;
-    for (int i = 0; i < max_retry_count; i++) {
-        int actualSize = 0;
-        ret = libusb_interrupt_transfer(handle,
-                                        property.outEndpoint,
-                                        data,
-                                        size,
-                                        &actualSize,
-                                        timeout_duration);
-        if (ret == LIBUSB_ERROR_PIPE) {
-            continue;
-        } else {
-            break;
-        }
-    }
-    if (ret != LIBUSB_SUCCESS) {
-        return USB_TRANSFER_ERROR;
-    }
-    return USB_SUCCESS;
+    return recvBulk(data, size, getPolicy(endpoint(LIBUSB_ENDPOINT_IN)), transferred);
 }
 
-int Usb::recvInterrupt(unsigned char *data, size_t size)
+int Usb::sendInterrupt(unsigned char *data, size_t size, size_t *transferred)
 {
-    if (handle == nullptr) {
-        return USB_INVALID_PARAM;
-    }
-    int ret = 0;
-    for (int i = 0; i < max_retry_count; i++) {
-        int actualSize = 0;
-        ret = libusb_interrupt_transfer(handle,
-                                        property.inEndpoint,
-                                        data,
-                                        size,
-                                        &actualSize,
-                                        timeout_duration);
-        if (ret == LIBUSB_ERROR_PIPE) {
-            continue;
-        } else {
-            break;
-        }
-    }
-    if (ret != LIBUSB_SUCCESS) {
-        return USB_TRANSFER_ERROR;
+    return sendInterrupt(data, size, getPolicy(endpoint(LIBUSB_ENDPOINT_OUT)), transferred);
+}
+
+int Usb::recvInterrupt(unsigned char *data, size_t size, size_t *transferred)
+{
+    return recvInterrupt(data, size, getPolicy(endpoint(LIBUSB_ENDPOINT_IN)), transferred);
+}
+
+int Usb::sendBulk(unsigned char *data, size_t size, const Policy &policy, size_t *transferred)
+{
+    return transfer<LIBUSB_TRANSFER_TYPE_BULK, LIBUSB_ENDPOINT_OUT>(data, size, policy, transferred);
+}
+
+int Usb::recvBulk(unsigned char *data, size_t size, const Policy &policy, size_t *transferred)
+{
+    return transfer<LIBUSB_TRANSFER_TYPE_BULK, LIBUSB_ENDPOINT_IN>(data, size, policy, transferred);
+}
+
+int Usb::sendInterrupt(unsigned char *data, size_t size, const Policy &policy, size_t *transferred)
+{
+    return transfer<LIBUSB_TRANSFER_TYPE_INTERRUPT, LIBUSB_ENDPOINT_OUT>(data, size, policy, transferred);
+}
+
+int Usb::recvInterrupt(unsigned char *data, size_t size, const Policy &policy, size_t *transferred)
+{
+    return transfer<LIBUSB_TRANSFER_TYPE_INTERRUPT, LIBUSB_ENDPOINT_IN>(data, size, policy, transferred);
+}
+
+void Usb::setPolicy(const Policy &policy)
+{
+    std::lock_guard<std::mutex> guard(policyMutex);
+    defaultPolicy = policy;
+    return;
+}
+
+void Usb::setPolicy(unsigned char endpoint, const Policy &policy)
+{
+    std::lock_guard<std::mutex> guard(policyMutex);
+    endpointPolicy[endpoint] = policy;
+    return;
+}
+
+Usb::Policy Usb::getPolicy(unsigned char endpoint) const
+{
+    std::lock_guard<std::mutex> guard(policyMutex);
+    std::map<unsigned char, Policy>::const_iterator it = endpointPolicy.find(endpoint);
+    if (it == endpointPolicy.end()) {
+        return defaultPolicy;
     }
-    return USB_SUCCESS;
+    return it->second;
 }
 
-int Usb::sendControl(unsigned char *data, size_t size)
+int Usb::sendControl(unsigned char requestType, unsigned char request,
+                     unsigned short value, unsigned short index,
+                     unsigned char *data, size_t size)
 {
-    if (handle == nullptr) {
+    DevicePtr dev = acquire();
+    if (dev == nullptr || (data == nullptr && size > 0) || size > 0xffff) {
         return USB_INVALID_PARAM;
     }
-    unsigned char requestType;
-    unsigned char bRequest;
-    unsigned short value;
-    unsigned short index;
-    int ret = libusb_control_transfer(handle, requestType, bRequest, value, index,
-                                      data, size, timeout_duration);
-    if (ret != LIBUSB_SUCCESS) {
+    requestType = (requestType & ~LIBUSB_ENDPOINT_DIR_MASK) | LIBUSB_ENDPOINT_OUT;
+    int ret = libusb_control_transfer(dev->handle, requestType, request, value, index,
+                                      data, size, getPolicy(0).timeout);
+    if (ret < 0) {
+        LOG_INFO("fail to send control", ret);
         return USB_TRANSFER_ERROR;
     }
     return USB_SUCCESS;
 }
 
-int Usb::recvControl(unsigned char *data, size_t size)
+int Usb::recvControl(unsigned char requestType, unsigned char request,
+                     unsigned short value, unsigned short index,
+                     unsigned char *data, size_t &size)
 {
-    if (handle == nullptr) {
+    DevicePtr dev = acquire();
+    if (dev == nullptr || data == nullptr || size > 0xffff) {
         return USB_INVALID_PARAM;
     }
-    unsigned char requestType;
-    unsigned char bRequest;
-    unsigned short value;
-    unsigned short index;
-    int ret = libusb_control_transfer(handle, requestType, bRequest, value, index,
-                                      data, size, timeout_duration);
-    if (ret != LIBUSB_SUCCESS) {
+    requestType = (requestType & ~LIBUSB_ENDPOINT_DIR_MASK) | LIBUSB_ENDPOINT_IN;
+    int ret = libusb_control_transfer(dev->handle, requestType, request, value, index,
+                                      data, size, getPolicy(0).timeout);
+    if (ret < 0) {
+        LOG_INFO("fail to recv control", ret);
         return USB_TRANSFER_ERROR;
     }
+    size = ret;
     return USB_SUCCESS;
 }
 
-int Usb::registerAttach(Usb::FnHotplugHandler attachHandler)
+int Usb::registerAttach()
 {
+    if (hasAttachHandler) {
+        return USB_SUCCESS;
+    }
     /* support */
     if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
         return USB_UNSUPPORT;
@@ -361,12 +442,16 @@ int Usb::registerAttach(Usb::FnHotplugHandler attachHandler)
     if (ret != LIBUSB_SUCCESS) {
         return USB_REGISTER_FAILED;
     }
+    hasAttachHandler = true;
     return USB_SUCCESS;
 
 }
 
-int Usb::registerDetach(Usb::FnHotplugHandler detachHandler)
+int Usb::registerDetach()
 {
+    if (hasDetachHandler) {
+        return USB_SUCCESS;
+    }
     /* capability */
     if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
         return USB_UNSUPPORT;
@@ -384,9 +469,23 @@ int Usb::registerDetach(Usb::FnHotplugHandler detachHandler)
     if (ret != LIBUSB_SUCCESS) {
         return USB_REGISTER_FAILED;
     }
+    hasDetachHandler = true;
     return LIBUSB_SUCCESS;
 }
 
+void Usb::deregisterHotplug()
+{
+    if (hasAttachHandler) {
+        libusb_hotplug_deregister_callback(Usb::context.get(), attachHandler);
+        hasAttachHandler = false;
+    }
+    if (hasDetachHandler) {
+        libusb_hotplug_deregister_callback(Usb::context.get(), detachHandler);
+        hasDetachHandler = false;
+    }
+    return;
+}
+
 int Usb::startHandleEvent()
 {
     if (eventThread != nullptr) {
@@ -402,7 +501,38 @@ int Usb::stopHandleEvent()
     isHandleEvent.store(false);
     if (eventThread != nullptr) {
         eventThread->join();
+        eventThread = nullptr;
+    }
+    return USB_SUCCESS;
+}
+
+void Usb::setEventThreadConfig(const ThreadConfig &config)
+{
+    eventThreadConfig = config;
+    return;
+}
+
+int Usb::setEventMode(int mode)
+{
+    if (mode != EVENT_BLOCK && mode != EVENT_BUSY_POLL) {
+        return USB_INVALID_PARAM;
+    }
+    if (isHandleEvent.load()) {
+        return USB_INVALID_CONTEXT;
+    }
+    eventMode = mode;
+    return USB_SUCCESS;
+}
+
+int Usb::setBackend(int backend_)
+{
+    if (backend_ == BACKEND_USBFS && !UsbFs::isSupported()) {
+        return USB_UNSUPPORT;
+    }
+    if (acquire() != nullptr) {
+        return USB_INVALID_PARAM;
     }
+    backend = backend_;
     return USB_SUCCESS;
 }
 
@@ -7,10 +7,14 @@
 #include <mutex>
 #include <vector>
 #include <atomic>
+#include <map>
+#include <chrono>
 #include <functional>
 #include <cstdlib>
 #include <cstring>
 #include "libusb.h"
+#include "threadconfig.h"
+#include "usbfs.h"
 
 #if 0
 #define LOG_INFO(message, ret) do { \
@@ -34,31 +38,69 @@ public:
         unsigned char outEndpoint;
     };
 
+    /* created on first use, later calls only pay an acquire load */
     class Context
     {
     public:
         std::mutex mutex;
-        libusb_context *context;
+        std::atomic<libusb_context*> context;
     public:
         Context():context(nullptr){}
         ~Context()
         {
             std::lock_guard<std::mutex> guard(mutex);
-            if (context != nullptr) {
-                libusb_exit(context);
-                context = nullptr;
+            libusb_context *ctx = context.exchange(nullptr);
+            if (ctx != nullptr) {
+                libusb_exit(ctx);
             }
         }
         libusb_context* get()
         {
+            libusb_context *ctx = context.load(std::memory_order_acquire);
+            if (ctx != nullptr) {
+                return ctx;
+            }
             std::lock_guard<std::mutex> guard(mutex);
-            if (context == nullptr) {
-                libusb_init(&context);
+            ctx = context.load(std::memory_order_relaxed);
+            if (ctx == nullptr) {
+                if (libusb_init(&ctx) != LIBUSB_SUCCESS) {
+                    return nullptr;
+                }
+                context.store(ctx, std::memory_order_release);
             }
-            return context;
+            return ctx;
         }
     };
 
+    enum EventMode {
+        EVENT_BLOCK = 0,
+        EVENT_BUSY_POLL
+    };
+
+    /* data path, control transfers and hotplug always go through libusb */
+    enum Backend {
+        BACKEND_LIBUSB = 0,
+        BACKEND_USBFS
+    };
+
+    /* an opened device. Every transfer holds a reference, so closing only
+       unpublishes it and the last transfer in flight releases the handle */
+    struct Device
+    {
+        libusb_device_handle *handle;
+        /* fixed for the life of the handle, so transfers read them lock-free */
+        unsigned char inEndpoint;
+        unsigned char outEndpoint;
+        int interfaceNum;
+        int backend;
+        bool isClaimed;
+        UsbFs usbfs;
+        Device():handle(nullptr), inEndpoint(0), outEndpoint(0),
+            interfaceNum(0), backend(BACKEND_LIBUSB), isClaimed(false){}
+        ~Device();
+    };
+    using DevicePtr = std::shared_ptr<Device>;
+
     enum Code {
         USB_SUCCESS = 0,
         USB_INVALID_PARAM,
@@ -66,7 +108,8 @@ public:
         USB_OPEN_FAILED,
         USB_TRANSFER_ERROR,
         USB_UNSUPPORT,
-        USB_REGISTER_FAILED
+        USB_REGISTER_FAILED,
+        USB_TIMEOUT
     };
 
     using FnHotplug = libusb_hotplug_callback_fn;
@@ -75,15 +118,64 @@ public:
     using FnDetachNotify = std::function<void(void)>;
     constexpr static int timeout_duration = 3000;
     constexpr static int max_retry_count = 3;
+    constexpr static int retry_backoff = 1;
+    /* busy poll: idle polls before backing off, and the longest backoff */
+    constexpr static int busy_poll_spin_count = 2000;
+    constexpr static int busy_poll_max_sleep_us = 500;
+    /* timeout and retry behaviour of one endpoint */
+    struct Policy
+    {
+        /* per attempt in ms, 0 waits forever */
+        int timeout;
+        /* whole call in ms including retries and backoff, 0 means none */
+        int deadline;
+        int retryCount;
+        /* first backoff in ms, doubled after every retry */
+        int backoff;
+        /* libusb_clear_halt before retrying a stalled endpoint */
+        bool clearHalt;
+        Policy():timeout(timeout_duration), deadline(0), retryCount(max_retry_count),
+            backoff(retry_backoff), clearHalt(true){}
+        Policy(int timeout_, int deadline_ = 0, int retryCount_ = max_retry_count):
+            timeout(timeout_), deadline(deadline_), retryCount(retryCount_),
+            backoff(retry_backoff), clearHalt(true){}
+    };
+    /* compile-time transfer policies */
+    struct Retry {constexpr static bool enabled = true;};
+    struct Once {constexpr static bool enabled = false;};
+    template<std::size_t n>
+    struct Chunk {constexpr static std::size_t size = n;};
+    using Whole = Chunk<0>;
+    /* transfer traits, specialized per libusb transfer type in usbtransfer.h */
+    template<int type>
+    struct Transfer;
 protected:
     Property property;
     /* device */
     static Context context;
-    libusb_device_handle *handle;
+    /* published with atomic_store, read with atomic_load */
+    DevicePtr device;
+    /* serializes open and close, transfers never take it */
+    std::mutex deviceMutex;
     int interfaceNum;
+    int backend;
+    /* policy, set from any thread while transfers read it */
+    mutable std::mutex policyMutex;
+    Policy defaultPolicy;
+    std::map<unsigned char, Policy> endpointPolicy;
     /* hotplug */
+    FnHotplugHandler attachHandler;
+    FnHotplugHandler detachHandler;
+    bool hasAttachHandler;
+    bool hasDetachHandler;
     std::atomic_bool isHandleEvent;
     std::shared_ptr<std::thread> eventThread;
+    ThreadConfig eventThreadConfig;
+    /* result of applying eventThreadConfig, a ThreadConfig code */
+    std::atomic<int> eventThreadStatus;
+    /* read once when the event thread starts */
+    std::atomic<int> eventMode;
+    std::atomic<unsigned long> eventCount;
     /* notify */
     FnAttachNotify attachNotify;
     FnDetachNotify detachNotify;
@@ -98,10 +190,18 @@ protected:
                       libusb_hotplug_event event,
                       void* userdata);
 
+    /* run on the event thread, sessions override them to defer the work */
+    virtual void onAttach();
+    virtual void onDetach();
     void handleEvent();
+    void pollEvent();
+    DevicePtr acquire() const {return std::atomic_load(&device);}
 public:
     Usb();
-    ~Usb();
+    virtual ~Usb();
+    static libusb_context* getContext() {return context.get();}
+    /* true inside transfer callbacks, blocking there stalls every completion */
+    static bool isEventThread();
     /* device */
     static int findEndpoint(libusb_device* dev, unsigned char &endpointIn, unsigned char &endpointOut);
     static std::vector<Usb::Property> enumerate();
@@ -109,22 +209,50 @@ public:
     int openDevice(unsigned short vendorID, unsigned short productID);
     int _openDevice();
     void closeDevice();
-    /* sync transfer */
-    int sendBulk(unsigned char *data, std::size_t size);
-    int recvBulk(unsigned char *data, std::size_t size);
-    int sendInterrupt(unsigned char *data, std::size_t size);
-    int recvInterrupt(unsigned char *data, std::size_t size);
-    int sendControl(unsigned char *data, std::size_t size);
-    int recvControl(unsigned char *data, std::size_t size);
+    bool isOpened() const {return acquire() != nullptr;}
+    /* endpoint of the open device for LIBUSB_ENDPOINT_IN or OUT, 0 when closed */
+    unsigned char endpoint(int direction) const;
+    /* takes effect on the next open */
+    virtual int setBackend(int backend_);
+    int getBackend() const {return backend;}
+    /* policy */
+    void setPolicy(const Policy &policy);
+    void setPolicy(unsigned char endpoint, const Policy &policy);
+    Policy getPolicy(unsigned char endpoint) const;
+    /* sync transfer engine, specialized per type, direction and policy */
+    template<int type, int direction, typename RetryPolicy = Retry, typename ChunkPolicy = Whole>
+    int transfer(unsigned char *data, std::size_t size, const Policy &policy, std::size_t *transferred = nullptr);
+    /* sync transfer, transferred is set on timeout as well */
+    int sendBulk(unsigned char *data, std::size_t size, std::size_t *transferred = nullptr);
+    int recvBulk(unsigned char *data, std::size_t size, std::size_t *transferred = nullptr);
+    int sendInterrupt(unsigned char *data, std::size_t size, std::size_t *transferred = nullptr);
+    int recvInterrupt(unsigned char *data, std::size_t size, std::size_t *transferred = nullptr);
+    int sendBulk(unsigned char *data, std::size_t size, const Policy &policy, std::size_t *transferred = nullptr);
+    int recvBulk(unsigned char *data, std::size_t size, const Policy &policy, std::size_t *transferred = nullptr);
+    int sendInterrupt(unsigned char *data, std::size_t size, const Policy &policy, std::size_t *transferred = nullptr);
+    int recvInterrupt(unsigned char *data, std::size_t size, const Policy &policy, std::size_t *transferred = nullptr);
+    int sendControl(unsigned char requestType, unsigned char request,
+                    unsigned short value, unsigned short index,
+                    unsigned char *data, std::size_t size);
+    int recvControl(unsigned char requestType, unsigned char request,
+                    unsigned short value, unsigned short index,
+                    unsigned char *data, std::size_t &size);
     /* register hotplug */
-    int registerAttach(FnHotplugHandler attachHandler);
-    int registerDetach(FnHotplugHandler detachHandler);
+    int registerAttach();
+    int registerDetach();
+    void deregisterHotplug();
     /* event */
     int startHandleEvent();
     int stopHandleEvent();
+    void setEventThreadConfig(const ThreadConfig &config);
+    int getEventThreadStatus() const {return eventThreadStatus.load();}
+    /* USB_INVALID_CONTEXT while the event thread runs, stop it first */
+    int setEventMode(int mode);
     /* notify */
     void registerAttachNotify(const FnAttachNotify &notify);
     void registerDetachNotify(const FnDetachNotify &notify);
 };
 
+#include "usbtransfer.h"
+
 #endif // USB_H
@@ -4,15 +4,40 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 SOURCES += \
+        clocksync.cpp \
+        framer.cpp \
         hid.cpp \
+        hidraw.cpp \
         main.cpp \
+        shmring.cpp \
+        snapshot.cpp \
+        soak.cpp \
+        threadconfig.cpp \
         usb.cpp \
-        usbasync.cpp
+        usbasync.cpp \
+        usbfs.cpp \
+        usbsession.cpp \
+        usbtransaction.cpp \
+        virtualhid.cpp \
+        warmup.cpp
 
 HEADERS += \
+    clocksync.h \
+    framer.h \
     hid.h \
+    hidraw.h \
+    shmring.h \
+    snapshot.h \
+    soak.h \
+    threadconfig.h \
     usb.h \
-    usbasync.h
+    usbasync.h \
+    usbfs.h \
+    usbsession.h \
+    usbtransaction.h \
+    usbtransfer.h \
+    virtualhid.h \
+    warmup.h
 
 PATH = D:/home/3rdparty
 # hid
@@ -21,4 +46,11 @@ LIBS += -L$$PATH/hidapi/lib -lhidapi
 # libusb
 INCLUDEPATH += $$PATH/libusb/include
 LIBS += -L$$PATH/libusb/static -llibusb-1.0
-
+# shared memory
+unix:!macx: LIBS += -lrt
+# soak build: qmake CONFIG+=soak, main runs test_soak and counts allocations
+# through operator new, malloc is only visible in the rss and heap gates
+soak {
+    TARGET = usb_soak
+    DEFINES += USB_SOAK SOAK_COUNT_ALLOC
+}
@@ -1,82 +1,535 @@
 #include "usbasync.h"
+#include <future>
 
-void UsbAsync::recv()
+struct UsbAsync::WriteContext
 {
-    while (1) {
-        {
-            std::unique_lock<std::mutex> locker(mutex);
-            condit.wait(locker, [this]()->bool{
-                            return state == STATE_RUN || state == STATE_TERMINATE;
-                        });
-            if (state == STATE_TERMINATE) {
-                break;
+    UsbAsync *usb;
+    /* keeps the handle open until libusb hands the transfer back */
+    DevicePtr device;
+    /* attempts left, only timeouts are retried. Stalls are not, since
+       clearing a halt is a synchronous call that cannot run on the event
+       thread, and a transfer error says nothing about what reached the device.
+       Isochronous writes are never retried, their packet layout is fixed */
+    int retry;
+    /* shared by the chunks of one write, frees a LIBUSB_TRANSFER_FREE_BUFFER
+       buffer once the last of them is handed back */
+    std::shared_ptr<unsigned char> owner;
+};
+
+struct UsbAsync::ControlBatch
+{
+    struct Slot
+    {
+        ControlBatch *batch;
+        std::size_t index;
+    };
+    UsbAsync *usb;
+    DevicePtr device;
+    std::vector<ControlRequest> requests;
+    std::vector<Slot> slots;
+    /* by slot, nullptr once libusb has handed the transfer back */
+    std::mutex mutex;
+    std::vector<libusb_transfer*> transfers;
+    std::atomic<std::size_t> remaining;
+    /* one per request and one for the submitter */
+    std::atomic<std::size_t> refs;
+    FnControl done;
+    void release()
+    {
+        if (--refs == 0) {
+            delete this;
+        }
+    }
+    void finish()
+    {
+        UsbAsync *usb_ = usb;
+        if (--remaining == 0) {
+            done(requests);
+        }
+        release();
+        usb_->finishRequest();
+    }
+    void cancel()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        for (std::size_t i = 0; i < transfers.size(); i++) {
+            if (transfers[i] != nullptr) {
+                libusb_cancel_transfer(transfers[i]);
             }
         }
-        libusb_transfer* inTransfer = libusb_alloc_transfer(0);
-        unsigned char *buf = new unsigned char[max_buffer_size];
-        memset(buf, 0, max_buffer_size);
-        inTransfer->actual_length = 0;
-        libusb_fill_bulk_transfer(inTransfer,
-                                  handle,
-                                  property.inEndpoint,
-                                  buf,
-                                  max_buffer_size,
-                                  UsbAsync::readHandler,
-                                  this,
-                                  timeout_duration);
-        inTransfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+    }
+};
+
+void UsbAsync::recv()
+{
+    recvThreadStatus = recvThreadConfig.apply();
+    if (recvThreadStatus.load() != ThreadConfig::THREAD_SUCCESS) {
+        LOG_INFO("fail to apply recv thread config", LIBUSB_ERROR_OTHER);
+    }
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        condit.wait(locker, [this]()->bool{
+                        return state == STATE_RUN || state == STATE_TERMINATE;
+                    });
+        if (state == STATE_TERMINATE) {
+            return;
+        }
+    }
+    if (backend == BACKEND_USBFS) {
+        recvUsbfs();
+        return;
+    }
+    /* the only dispatch on type, the ring itself is specialized */
+    switch (transferType) {
+    case TYPE_INTERRUPT:
+        recvRing<LIBUSB_TRANSFER_TYPE_INTERRUPT>();
+        break;
+    case TYPE_ISOCHRONOUS:
+        recvRing<LIBUSB_TRANSFER_TYPE_ISOCHRONOUS>();
+        break;
+    default:
+        recvRing<LIBUSB_TRANSFER_TYPE_BULK>();
+        break;
+    }
+    return;
+}
+
+template<int type>
+void UsbAsync::recvRing()
+{
+    /* held until every transfer of the ring has been freed */
+    DevicePtr dev = acquire();
+    if (dev == nullptr) {
+        return;
+    }
+    if (isAutoTune) {
+        tune();
+    }
+    /* allocate the ring from this thread so it lands on the pinned node */
+    std::size_t length = Transfer<type>::length(dev->handle, dev->inEndpoint, bufferSize.load());
+    std::size_t count = transferNum.load();
+    std::size_t ringSize = length*count;
+    unsigned char *ring = static_cast<unsigned char*>(recvThreadConfig.allocate(ringSize));
+    if (ring == nullptr) {
+        return;
+    }
+    int timeout = getPolicy(dev->inEndpoint).timeout;
+    std::vector<libusb_transfer*> transfers;
+    for (std::size_t i = 0; i < count; i++) {
+        libusb_transfer* inTransfer = libusb_alloc_transfer(Transfer<type>::iso_packet_num);
+        if (inTransfer == nullptr) {
+            break;
+        }
+        Transfer<type>::fill(inTransfer,
+                             dev->handle,
+                             dev->inEndpoint,
+                             ring + i*length,
+                             length,
+                             UsbAsync::readHandler<type>,
+                             this,
+                             timeout);
+        pendingTransfers++;
         int ret = libusb_submit_transfer(inTransfer);
         if (ret < 0) {
-            libusb_cancel_transfer(inTransfer);
+            pendingTransfers--;
             libusb_free_transfer(inTransfer);
-            inTransfer = nullptr;
             continue;
         }
+        transfers.push_back(inTransfer);
+    }
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        condit.wait(locker, [this]()->bool{
+                        return state == STATE_TERMINATE;
+                    });
+    }
+    /* cancel and wait for the event thread to hand every transfer back, a
+       slow cancel is cancelled once more. The wait is bounded, with no event
+       thread left nothing would ever come back and stop() would hang */
+    bool isDrained = false;
+    for (int attempt = 0; attempt < 2 && !isDrained; attempt++) {
+        for (std::size_t i = 0; i < transfers.size(); i++) {
+            libusb_cancel_transfer(transfers[i]);
+        }
+        std::unique_lock<std::mutex> locker(mutex);
+        isDrained = condit.wait_for(locker, std::chrono::milliseconds(timeout_duration), [this]()->bool{
+                                        return pendingTransfers.load() == 0;
+                                    });
+    }
+    if (!isDrained) {
+        /* libusb may still own them, leaking beats freeing under its feet */
+        LOG_INFO("ring not drained", LIBUSB_ERROR_TIMEOUT);
+        return;
+    }
+    for (std::size_t i = 0; i < transfers.size(); i++) {
+        libusb_free_transfer(transfers[i]);
     }
+    recvThreadConfig.release(ring, ringSize);
     return;
 }
 
-void UsbAsync::writeHandler(libusb_transfer *transfer)
+void UsbAsync::recvUsbfs()
 {
-    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-        int ret = libusb_submit_transfer(transfer);
+    DevicePtr dev = acquire();
+    if (dev == nullptr) {
+        return;
+    }
+    if (isAutoTune) {
+        tune();
+    }
+    int type = transferType == TYPE_INTERRUPT ? LIBUSB_TRANSFER_TYPE_INTERRUPT : LIBUSB_TRANSFER_TYPE_BULK;
+    int ret = dev->usbfs.startRing(dev->inEndpoint, type, bufferSize.load(), transferNum.load());
+    if (ret != LIBUSB_SUCCESS) {
+        LOG_INFO("fail to start usbfs ring", ret);
+        return;
+    }
+    /* usbfs keeps no completion time, the reap is the closest we get */
+    UsbFs::FnProcess deliver = [this](unsigned char *data, std::size_t size) {
+        updateLatency();
+        dispatch(data, size, ClockSync::now());
+    };
+    /* one reap batch per wakeup instead of one callback per transfer */
+    while (state == STATE_RUN) {
+        ret = dev->usbfs.pump(deliver, usbfs_pump_timeout);
         if (ret < 0) {
-           libusb_cancel_transfer(transfer);
+            LOG_INFO("usbfs ring stopped", ret);
+            break;
         }
-    } else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+    }
+    ret = dev->usbfs.stopRing(timeout_duration);
+    if (ret != LIBUSB_SUCCESS) {
+        /* the next startRing or close finishes the reap */
+        LOG_INFO("usbfs ring still in flight", ret);
+    }
+    return;
+}
+
+void UsbAsync::finishTransfer()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    pendingTransfers--;
+    condit.notify_all();
+    return;
+}
+
+void UsbAsync::finishRequest()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    pendingRequests--;
+    condit.notify_all();
+    return;
+}
 
+void UsbAsync::trackRequest(libusb_transfer *transfer, bool inflight)
+{
+    std::lock_guard<std::mutex> guard(requestMutex);
+    if (inflight) {
+        requestTransfers.insert(transfer);
+    } else {
+        requestTransfers.erase(transfer);
+    }
+    return;
+}
+
+void UsbAsync::cancelRequests()
+{
+    /* handlers untrack under the same lock before freeing, so none is freed here */
+    std::lock_guard<std::mutex> guard(requestMutex);
+    for (auto it = requestTransfers.begin(); it != requestTransfers.end(); ++it) {
+        libusb_cancel_transfer(*it);
+    }
+    return;
+}
+
+bool UsbAsync::drainRequests(int timeout)
+{
+    if (waitRequests(timeout)) {
+        return true;
+    }
+    cancelRequests();
+    if (waitRequests(timeout)) {
+        return true;
+    }
+    LOG_INFO("requests still in flight", LIBUSB_ERROR_TIMEOUT);
+    return false;
+}
+
+bool UsbAsync::waitRequests(int timeout)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return condit.wait_for(locker, std::chrono::milliseconds(timeout), [this]()->bool{
+                               return pendingRequests.load() == 0;
+                           });
+}
+
+void UsbAsync::updateLatency()
+{
+    long long t0 = requestTime.exchange(0);
+    if (t0 == 0) {
+        return;
+    }
+    double t = double(ClockSync::now() - t0)/1000.0;
+    std::lock_guard<std::mutex> guard(latencyMutex);
+    if (latency.count == 0 || t < latency.min) {
+        latency.min = t;
+    }
+    if (t > latency.max) {
+        latency.max = t;
+    }
+    latency.last = t;
+    latency.total += t;
+    latency.count++;
+    return;
+}
+
+void UsbAsync::dispatch(unsigned char *data, std::size_t size, long long timestamp)
+{
+    if (isTimed) {
+        timedProcess(data, size, timestamp);
+    } else {
+        process(data, size);
     }
+    return;
+}
+
+void UsbAsync::writeHandler(libusb_transfer *transfer)
+{
+    WriteContext *context = static_cast<WriteContext*>(transfer->user_data);
+    context->usb->eventCount++;
+    if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT && context->retry > 1) {
+        context->retry--;
+        /* the endpoint already took actual_length bytes, send only the rest */
+        transfer->buffer += transfer->actual_length;
+        transfer->length -= transfer->actual_length;
+        int ret = libusb_submit_transfer(transfer);
+        if (ret == LIBUSB_SUCCESS) {
+            /* still owned by libusb */
+            return;
+        }
+    }
+    UsbAsync *usb = context->usb;
+    usb->trackRequest(transfer, false);
+    delete context;
     libusb_free_transfer(transfer);
+    usb->finishRequest();
     return;
 }
 
+template<int type>
 void UsbAsync::readHandler(libusb_transfer *transfer)
 {
-    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-        if (transfer->actual_length > 0) {
-            UsbAsync* this_ = static_cast<UsbAsync*>(transfer->user_data);
-            this_->process(transfer->buffer, transfer->actual_length);
-        }
-        int ret = libusb_submit_transfer(transfer);
-        if (ret < 0) {
-            printf("error libusb_submit_transfer : %s\n", libusb_strerror(libusb_error(ret)));
-            libusb_cancel_transfer(transfer);
+    /* stamp before anything else runs on the event thread */
+    long long timestamp = ClockSync::now();
+    UsbAsync* this_ = static_cast<UsbAsync*>(transfer->user_data);
+    this_->eventCount++;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED ||
+            transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+        auto deliver = [this_, timestamp](unsigned char *data, std::size_t size) {
+            this_->updateLatency();
+            this_->dispatch(data, size, timestamp);
+        };
+        Transfer<type>::deliver(transfer, deliver);
+        if (this_->state == STATE_RUN) {
+            int ret = libusb_submit_transfer(transfer);
+            if (ret == LIBUSB_SUCCESS) {
+                return;
+            }
+            LOG_INFO("fail to resubmit transfer", ret);
         }
-    } else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-        libusb_free_transfer(transfer);
     }
+    /* cancelled, failed or stopping: the transfer is back with recv() */
+    this_->finishTransfer();
     return;
 }
 
-UsbAsync::UsbAsync()
+void UsbAsync::controlHandler(libusb_transfer *transfer)
 {
+    ControlBatch::Slot *slot = static_cast<ControlBatch::Slot*>(transfer->user_data);
+    ControlBatch *batch = slot->batch;
+    ControlRequest &request = batch->requests[slot->index];
+    batch->usb->eventCount++;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        if (request.requestType & LIBUSB_ENDPOINT_IN) {
+            request.data.assign(libusb_control_transfer_get_data(transfer),
+                                libusb_control_transfer_get_data(transfer) + transfer->actual_length);
+        }
+        request.code = USB_SUCCESS;
+    } else {
+        request.code = USB_TRANSFER_ERROR;
+    }
+    {
+        std::lock_guard<std::mutex> guard(batch->mutex);
+        batch->transfers[slot->index] = nullptr;
+    }
+    batch->usb->trackRequest(transfer, false);
+    libusb_free_transfer(transfer);
+    batch->finish();
+    return;
+}
 
+UsbAsync::UsbAsync():
+    state(STATE_NONE),
+    isTimed(false),
+    recvThreadStatus(ThreadConfig::THREAD_SUCCESS),
+    pendingTransfers(0),
+    pendingRequests(0),
+    transferType(TYPE_BULK),
+    submitWrite(&UsbAsync::writeTransfer<LIBUSB_TRANSFER_TYPE_BULK>),
+    bufferSize(max_buffer_size),
+    transferNum(max_transfer_num),
+    isAutoTune(false),
+    requestTime(0)
+{
+    process = [](unsigned char*, std::size_t){};
+    timedProcess = [](unsigned char*, std::size_t, long long){};
 }
 
 UsbAsync::~UsbAsync()
 {
-    stop();
-    recvThread.join();
+    stopRecv();
+    /* write and control handlers point back here, and another Usb's event
+       thread can still reap them from the shared context after we are gone */
+    drainRequests(timeout_duration);
+}
+
+int UsbAsync::setBackend(int backend_)
+{
+    /* usbfs claims the interface, so libusb could not carry an iso ring either */
+    if (backend_ == BACKEND_USBFS && transferType == TYPE_ISOCHRONOUS) {
+        return USB_UNSUPPORT;
+    }
+    return Usb::setBackend(backend_);
+}
+
+int UsbAsync::setTransferType(int type)
+{
+    if (type == TYPE_ISOCHRONOUS && backend == BACKEND_USBFS) {
+        return USB_UNSUPPORT;
+    }
+    transferType = type;
+    /* writes resolve their specialization here instead of per call */
+    switch (type) {
+    case TYPE_INTERRUPT:
+        submitWrite = &UsbAsync::writeTransfer<LIBUSB_TRANSFER_TYPE_INTERRUPT>;
+        break;
+    case TYPE_ISOCHRONOUS:
+        submitWrite = &UsbAsync::writeTransfer<LIBUSB_TRANSFER_TYPE_ISOCHRONOUS>;
+        break;
+    default:
+        submitWrite = &UsbAsync::writeTransfer<LIBUSB_TRANSFER_TYPE_BULK>;
+        break;
+    }
+    return USB_SUCCESS;
+}
+
+void UsbAsync::setBufferSize(std::size_t size, std::size_t num)
+{
+    bufferSize = size == 0 ? max_buffer_size : size;
+    transferNum = num == 0 ? max_transfer_num : num;
+    isAutoTune = false;
+    return;
+}
+
+int UsbAsync::tune()
+{
+    DevicePtr dev = acquire();
+    if (dev == nullptr) {
+        return USB_INVALID_PARAM;
+    }
+    libusb_device *usbDev = libusb_get_device(dev->handle);
+    int speed = libusb_get_device_speed(usbDev);
+    std::size_t maxPacketSize = 0;
+    std::size_t maxBurst = 1;
+    libusb_config_descriptor *configDesc = nullptr;
+    int ret = libusb_get_active_config_descriptor(usbDev, &configDesc);
+    if (ret != LIBUSB_SUCCESS) {
+        return USB_TRANSFER_ERROR;
+    }
+    for (int i = 0; i < configDesc->bNumInterfaces && maxPacketSize == 0; i++) {
+        const libusb_interface &iface = configDesc->interface[i];
+        for (int j = 0; j < iface.num_altsetting && maxPacketSize == 0; j++) {
+            for (int k = 0; k < iface.altsetting[j].bNumEndpoints; k++) {
+                const libusb_endpoint_descriptor *endpoint = &iface.altsetting[j].endpoint[k];
+                if (endpoint->bEndpointAddress != dev->inEndpoint) {
+                    continue;
+                }
+                /* bits 11..12 carry the high speed additional transactions */
+                maxPacketSize = endpoint->wMaxPacketSize & 0x7ff;
+                maxBurst = ((endpoint->wMaxPacketSize >> 11) & 0x3) + 1;
+                libusb_ss_endpoint_companion_descriptor *companion = nullptr;
+                if (speed >= LIBUSB_SPEED_SUPER &&
+                        libusb_get_ss_endpoint_companion_descriptor(context.get(), endpoint, &companion) == LIBUSB_SUCCESS) {
+                    maxBurst = std::size_t(companion->bMaxBurst) + 1;
+                    libusb_free_ss_endpoint_companion_descriptor(companion);
+                }
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(configDesc);
+    if (maxPacketSize == 0) {
+        return USB_INVALID_PARAM;
+    }
+    std::size_t packets = 16;
+    std::size_t num = max_transfer_num;
+    if (transferType == TYPE_INTERRUPT) {
+        /* one service interval per transfer keeps latency down */
+        packets = 1;
+    } else if (speed == LIBUSB_SPEED_HIGH) {
+        packets = 32;
+        num = 8;
+    } else if (speed >= LIBUSB_SPEED_SUPER) {
+        packets = 16;
+        num = 16;
+    }
+    std::size_t size = maxPacketSize*maxBurst*packets;
+    if (size > max_tuned_buffer_size) {
+        /* stay a multiple of the packet size so the device never overflows */
+        size = max_tuned_buffer_size/(maxPacketSize*maxBurst)*(maxPacketSize*maxBurst);
+    }
+    bufferSize = size;
+    transferNum = num > max_tuned_transfer_num ? max_tuned_transfer_num : num;
+    return USB_SUCCESS;
+}
+
+int UsbAsync::calibrate(const std::vector<std::size_t> &sizes, int duration)
+{
+    if (!isOpened() || sizes.empty()) {
+        return USB_INVALID_PARAM;
+    }
+    Policy policy = getPolicy(endpoint(LIBUSB_ENDPOINT_IN));
+    policy.timeout = duration;
+    policy.deadline = duration;
+    std::size_t bestSize = 0;
+    double bestRate = 0;
+    for (std::size_t i = 0; i < sizes.size(); i++) {
+        std::vector<unsigned char> buffer(sizes[i]);
+        std::size_t total = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        auto t1 = t0;
+        while (t1 - t0 < std::chrono::milliseconds(duration)) {
+            std::size_t transferred = 0;
+            int ret = transferType == TYPE_INTERRUPT ?
+                        transfer<LIBUSB_TRANSFER_TYPE_INTERRUPT, LIBUSB_ENDPOINT_IN, Once>(buffer.data(), buffer.size(), policy, &transferred) :
+                        transfer<LIBUSB_TRANSFER_TYPE_BULK, LIBUSB_ENDPOINT_IN, Once>(buffer.data(), buffer.size(), policy, &transferred);
+            total += transferred;
+            t1 = std::chrono::steady_clock::now();
+            if (ret != USB_SUCCESS) {
+                break;
+            }
+        }
+        double elapsed = std::chrono::duration<double>(t1 - t0).count();
+        double rate = elapsed > 0 ? total/elapsed : 0;
+        if (rate > bestRate) {
+            bestRate = rate;
+            bestSize = sizes[i];
+        }
+    }
+    if (bestSize == 0) {
+        return USB_TRANSFER_ERROR;
+    }
+    setBufferSize(bestSize, transferNum.load());
+    return USB_SUCCESS;
 }
 
 int UsbAsync::start(unsigned short vendorID, unsigned short productID)
@@ -86,10 +539,32 @@ int UsbAsync::start(unsigned short vendorID, unsigned short productID)
         return USB_OPEN_FAILED;
     }
     Usb::startHandleEvent();
+    return startRecv();
+}
+
+int UsbAsync::startRecv()
+{
+    if (recvThread.joinable()) {
+        return USB_SUCCESS;
+    }
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        state = STATE_RUN;
+    }
     recvThread = std::thread(&UsbAsync::recv, this);
     return USB_SUCCESS;
 }
 
+void UsbAsync::stopRecv()
+{
+    stop();
+    /* recv() returns once every transfer of the ring has been drained */
+    if (recvThread.joinable()) {
+        recvThread.join();
+    }
+    return;
+}
+
 void UsbAsync::stop()
 {
     std::unique_lock<std::mutex> locker(mutex);
@@ -98,27 +573,214 @@ void UsbAsync::stop()
     return;
 }
 
+template<int type>
+int UsbAsync::writeTransfer(unsigned char *data, size_t size, unsigned char flags)
+{
+    DevicePtr dev = acquire();
+    if (dev == nullptr) {
+        return USB_INVALID_PARAM;
+    }
+    std::shared_ptr<unsigned char> owner;
+    if (flags & LIBUSB_TRANSFER_FREE_BUFFER) {
+        owner = std::shared_ptr<unsigned char>(data, free);
+        flags &= ~LIBUSB_TRANSFER_FREE_BUFFER;
+    }
+    /* bulk and interrupt go whole, isochronous in max packet size x iso_packet_num chunks */
+    std::size_t chunk = Transfer<type>::length(dev->handle, dev->outEndpoint, size);
+    Policy policy = getPolicy(dev->outEndpoint);
+    for (std::size_t pos = 0; pos < size; pos += chunk) {
+        std::size_t length = size - pos < chunk ? size - pos : chunk;
+        libusb_transfer *outTransfer = libusb_alloc_transfer(Transfer<type>::iso_packet_num); // async transfer
+        if (outTransfer == nullptr) {
+            return USB_TRANSFER_ERROR;
+        }
+        WriteContext *context = new WriteContext;
+        context->usb = this;
+        context->device = dev;
+        context->retry = Transfer<type>::iso_packet_num > 0 ? 0 : policy.retryCount;
+        context->owner = owner;
+        Transfer<type>::fill(outTransfer,
+                             dev->handle,
+                             dev->outEndpoint,
+                             data + pos,
+                             length,
+                             UsbAsync::writeHandler,
+                             context,
+                             policy.timeout);
+        outTransfer->flags = flags;
+        requestTime = ClockSync::now();
+        pendingRequests++;
+        trackRequest(outTransfer, true);
+        int ret = libusb_submit_transfer(outTransfer);
+        if (ret != LIBUSB_SUCCESS) {
+            trackRequest(outTransfer, false);
+            pendingRequests--;
+            delete context;
+            libusb_free_transfer(outTransfer);
+            return USB_TRANSFER_ERROR;
+        }
+    }
+    return USB_SUCCESS;
+}
+
 int UsbAsync::write(unsigned char *data, size_t size)
 {
     if (data == nullptr || size == 0) {
         return USB_INVALID_PARAM;
     }
+    if (backend == BACKEND_USBFS) {
+        /* usbfs copies into its own urb, reaped by the recv thread, so it needs a running ring */
+        DevicePtr dev = acquire();
+        if (dev == nullptr) {
+            return USB_INVALID_PARAM;
+        }
+        int type = transferType == TYPE_INTERRUPT ? LIBUSB_TRANSFER_TYPE_INTERRUPT : LIBUSB_TRANSFER_TYPE_BULK;
+        requestTime = ClockSync::now();
+        return dev->usbfs.write(dev->outEndpoint, type, data, size) == LIBUSB_SUCCESS ?
+                    USB_SUCCESS : USB_TRANSFER_ERROR;
+    }
+    return (this->*submitWrite)(data, size, 0);
+}
 
-    libusb_transfer *outTransfer = libusb_alloc_transfer(0); // 0 -> specify a async transfer
-
-    libusb_fill_bulk_transfer(outTransfer,
-                              handle,
-                              property.outEndpoint,
-                              data,
-                              size,
-                              UsbAsync::writeHandler,
-                              this,
-                              timeout_duration);
-    outTransfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-    int ret = libusb_submit_transfer(outTransfer);
-    if (ret != LIBUSB_SUCCESS) {
+int UsbAsync::write(const std::vector<unsigned char> &data)
+{
+    if (data.empty()) {
+        return USB_INVALID_PARAM;
+    }
+    if (backend == BACKEND_USBFS) {
+        return write(const_cast<unsigned char*>(data.data()), data.size());
+    }
+    /* the transfer owns the copy and frees it on completion */
+    unsigned char *buffer = static_cast<unsigned char*>(malloc(data.size()));
+    if (buffer == nullptr) {
         return USB_TRANSFER_ERROR;
     }
+    memcpy(buffer, data.data(), data.size());
+    return (this->*submitWrite)(buffer, data.size(), LIBUSB_TRANSFER_FREE_BUFFER);
+}
+
+UsbAsync::Latency UsbAsync::getLatency()
+{
+    std::lock_guard<std::mutex> guard(latencyMutex);
+    return latency;
+}
+
+void UsbAsync::resetLatency()
+{
+    std::lock_guard<std::mutex> guard(latencyMutex);
+    latency = Latency();
+    return;
+}
+
+int UsbAsync::submitControl(const std::vector<UsbAsync::ControlRequest> &requests,
+                            const UsbAsync::FnControl &done)
+{
+    ControlBatch *batch = nullptr;
+    int ret = queueControl(requests, done, batch);
+    if (ret == USB_SUCCESS) {
+        batch->release();
+    }
+    return ret;
+}
+
+int UsbAsync::queueControl(const std::vector<UsbAsync::ControlRequest> &requests,
+                           const UsbAsync::FnControl &done, UsbAsync::ControlBatch* &batch)
+{
+    batch = nullptr;
+    DevicePtr dev = acquire();
+    if (dev == nullptr || requests.empty()) {
+        return USB_INVALID_PARAM;
+    }
+    for (std::size_t i = 0; i < requests.size(); i++) {
+        if (requests[i].data.size() > 0xffff) {
+            return USB_INVALID_PARAM;
+        }
+    }
+    batch = new ControlBatch;
+    batch->usb = this;
+    batch->device = dev;
+    batch->requests = requests;
+    batch->slots.resize(requests.size());
+    batch->transfers.assign(requests.size(), nullptr);
+    batch->remaining = requests.size();
+    batch->refs = requests.size() + 1;
+    batch->done = done;
+    pendingRequests += requests.size();
+    for (std::size_t i = 0; i < requests.size(); i++) {
+        ControlRequest &request = batch->requests[i];
+        ControlBatch::Slot &slot = batch->slots[i];
+        slot.batch = batch;
+        slot.index = i;
+        std::size_t length = request.data.size();
+        libusb_transfer *transfer = libusb_alloc_transfer(0);
+        unsigned char *buffer = static_cast<unsigned char*>(malloc(LIBUSB_CONTROL_SETUP_SIZE + length));
+        if (transfer == nullptr || buffer == nullptr) {
+            libusb_free_transfer(transfer);
+            free(buffer);
+            request.code = USB_TRANSFER_ERROR;
+            batch->finish();
+            continue;
+        }
+        libusb_fill_control_setup(buffer, request.requestType, request.request,
+                                  request.value, request.index, length);
+        if (!(request.requestType & LIBUSB_ENDPOINT_IN) && length > 0) {
+            memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, request.data.data(), length);
+        }
+        libusb_fill_control_transfer(transfer, dev->handle, buffer,
+                                     UsbAsync::controlHandler, &slot, getPolicy(0).timeout);
+        transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        {
+            std::lock_guard<std::mutex> guard(batch->mutex);
+            batch->transfers[i] = transfer;
+        }
+        trackRequest(transfer, true);
+        int ret = libusb_submit_transfer(transfer);
+        if (ret != LIBUSB_SUCCESS) {
+            trackRequest(transfer, false);
+            {
+                std::lock_guard<std::mutex> guard(batch->mutex);
+                batch->transfers[i] = nullptr;
+            }
+            libusb_free_transfer(transfer);
+            request.code = USB_TRANSFER_ERROR;
+            batch->finish();
+        }
+    }
     return USB_SUCCESS;
 }
 
+int UsbAsync::control(std::vector<UsbAsync::ControlRequest> &requests)
+{
+    /* completions run on the event thread, without one this would wait forever */
+    if (!isHandleEvent.load() || isEventThread()) {
+        return USB_INVALID_CONTEXT;
+    }
+    /* shared with the callback, which may outlive this call after a timeout */
+    using Result = std::promise<std::vector<ControlRequest> >;
+    std::shared_ptr<Result> result = std::make_shared<Result>();
+    std::future<std::vector<ControlRequest> > future = result->get_future();
+    ControlBatch *batch = nullptr;
+    int ret = queueControl(requests, [result](std::vector<ControlRequest> &done) {
+        result->set_value(done);
+    }, batch);
+    if (ret != USB_SUCCESS) {
+        return ret;
+    }
+    int timeout = getPolicy(0).timeout;
+    if (timeout > 0 && future.wait_for(std::chrono::milliseconds(timeout*requests.size())) ==
+            std::future_status::timeout) {
+        batch->cancel();
+    }
+    batch->release();
+    /* cancelled transfers still come back through the event thread */
+    if (future.wait_for(std::chrono::milliseconds(timeout_duration)) == std::future_status::timeout) {
+        return USB_TIMEOUT;
+    }
+    requests = future.get();
+    for (std::size_t i = 0; i < requests.size(); i++) {
+        if (requests[i].code != USB_SUCCESS) {
+            return USB_TRANSFER_ERROR;
+        }
+    }
+    return USB_SUCCESS;
+}
@@ -1,11 +1,13 @@
 #ifndef USBASYNC_H
 #define USBASYNC_H
+#include <set>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
 #include "usb.h"
+#include "clocksync.h"
 
 class UsbAsync : public Usb
 {
@@ -18,27 +20,137 @@ public:
     enum Type {
         TYPE_BULK = 0,
         TYPE_INTERRUPT,
-        TYPE_CONTROL
+        TYPE_CONTROL,
+        TYPE_ISOCHRONOUS
     };
+    /* request to response latency in microseconds */
+    struct Latency
+    {
+        std::size_t count;
+        double last;
+        double min;
+        double max;
+        double total;
+        Latency():count(0), last(0), min(0), max(0), total(0){}
+        double mean() const {return count == 0 ? 0 : total/count;}
+    };
+    /* one setup packet of a control batch */
+    struct ControlRequest
+    {
+        unsigned char requestType;
+        unsigned char request;
+        unsigned short value;
+        unsigned short index;
+        /* out: payload, in: sized to wLength and trimmed to the actual length */
+        std::vector<unsigned char> data;
+        int code;
+        ControlRequest():requestType(0), request(0), value(0), index(0), code(USB_SUCCESS){}
+        ControlRequest(unsigned char requestType_, unsigned char request_,
+                       unsigned short value_, unsigned short index_, std::size_t length = 0):
+            requestType(requestType_), request(request_), value(value_), index(index_),
+            data(length, 0), code(USB_SUCCESS){}
+    };
+    using FnControl = std::function<void(std::vector<ControlRequest>&)>;
     using FnProcess = std::function<void(unsigned char*, std::size_t)>;
+    /* timestamp: ClockSync::now() when the transfer completed */
+    using FnTimedProcess = std::function<void(unsigned char*, std::size_t, long long)>;
     constexpr static std::size_t max_buffer_size = 1024;
+    constexpr static std::size_t max_transfer_num = 4;
+    /* upper bounds for auto tuning */
+    constexpr static std::size_t max_tuned_buffer_size = 1024*1024;
+    constexpr static std::size_t max_tuned_transfer_num = 32;
+    constexpr static int calibrate_duration = 200;
+    /* how long the usbfs pump sleeps before checking the state again */
+    constexpr static int usbfs_pump_timeout = 100;
 protected:
+    struct WriteContext;
+    struct ControlBatch;
     std::thread recvThread;
     std::mutex mutex;
     std::condition_variable condit;
-    int state;
+    /* written under mutex, read lock-free by the event and recv threads */
+    std::atomic<int> state;
     FnProcess process;
+    FnTimedProcess timedProcess;
+    bool isTimed;
+    /* read ring */
+    ThreadConfig recvThreadConfig;
+    std::atomic<int> recvThreadStatus;
+    std::atomic<int> pendingTransfers;
+    /* writes and control transfers still owned by libusb */
+    std::atomic<int> pendingRequests;
+    std::mutex requestMutex;
+    std::set<libusb_transfer*> requestTransfers;
+    int transferType;
+    int (UsbAsync::*submitWrite)(unsigned char*, std::size_t, unsigned char);
+    /* ring geometry, tune() writes it on the recv thread */
+    std::atomic<std::size_t> bufferSize;
+    std::atomic<std::size_t> transferNum;
+    /* off by default, the ring keeps max_buffer_size x max_transfer_num */
+    std::atomic_bool isAutoTune;
+    /* latency */
+    std::mutex latencyMutex;
+    std::atomic<long long> requestTime;
+    Latency latency;
 protected:
     void recv();
+    template<int type>
+    void recvRing();
+    void recvUsbfs();
+    int startRecv();
+    void stopRecv();
+    void finishRequest();
+    bool waitRequests(int timeout);
+    void trackRequest(libusb_transfer *transfer, bool inflight);
+    void cancelRequests();
+    /* waits for writes and control batches, cancels them if they take too long */
+    bool drainRequests(int timeout);
+    void finishTransfer();
+    void updateLatency();
+    void dispatch(unsigned char *data, std::size_t size, long long timestamp);
+    /* on success batch holds a reference the caller releases */
+    int queueControl(const std::vector<ControlRequest> &requests, const FnControl &done, ControlBatch* &batch);
+    template<int type>
+    int writeTransfer(unsigned char *data, std::size_t size, unsigned char flags);
     static void writeHandler(libusb_transfer *transfer);
+    template<int type>
     static void readHandler(libusb_transfer *transfer);
+    static void controlHandler(libusb_transfer *transfer);
 public:
     UsbAsync();
     ~UsbAsync();
-    void registerProcess(const FnProcess &func) {process = func;}
+    /* the read ring calls process without a lock, register before start */
+    bool isReceiving() const {return state.load() == STATE_RUN;}
+    void registerProcess(const FnProcess &func) {process = func; isTimed = false;}
+    void registerTimedProcess(const FnTimedProcess &func) {timedProcess = func; isTimed = true;}
+    void setRecvThreadConfig(const ThreadConfig &config) {recvThreadConfig = config;}
+    /* ThreadConfig code of the last recv thread start */
+    int getRecvThreadStatus() const {return recvThreadStatus.load();}
+    /* usbfs has no isochronous ring, the pair is refused either way round */
+    int setBackend(int backend_);
+    int setTransferType(int type);
+    /* ring geometry, a fixed size turns auto tuning off */
+    void setBufferSize(std::size_t size, std::size_t num = max_transfer_num);
+    void setAutoTune(bool on) {isAutoTune = on;}
+    std::size_t getBufferSize() const {return bufferSize.load();}
+    std::size_t getTransferNum() const {return transferNum.load();}
+    /* size the ring from link speed, max packet size and burst */
+    int tune();
+    /* reads the in endpoint with every candidate size and keeps the fastest.
+       Needs openDevice() first and returns USB_INVALID_PARAM on a closed
+       device. The data read here is discarded, so run it before start() */
+    int calibrate(const std::vector<std::size_t> &sizes, int duration = calibrate_duration);
+    Latency getLatency();
+    void resetLatency();
     int start(unsigned short vendorID, unsigned short productID);
     void stop();
     int write(unsigned char* data, std::size_t size);
+    int write(const std::vector<unsigned char> &data);
+    /* queue every request back-to-back, done runs once all have completed */
+    int submitControl(const std::vector<ControlRequest> &requests, const FnControl &done);
+    /* sync, needs the event thread running and must not be called from it.
+       Requests still out after the control timeout per request are cancelled */
+    int control(std::vector<ControlRequest> &requests);
     int read(unsigned char* &data, std::size_t &size);
 };
 
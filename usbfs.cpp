@@ -0,0 +1,480 @@
+#include "usbfs.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include "libusb.h"
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/usbdevice_fs.h>
+
+struct UsbFs::Urb
+{
+    std::size_t size;
+    bool isRead;
+    bool isMapped;
+    /* last, it ends with the iso frame array */
+    usbdevfs_urb urb;
+};
+
+static int errorCode(int err)
+{
+    switch (err) {
+    case ETIMEDOUT:
+        return LIBUSB_ERROR_TIMEOUT;
+    case EPIPE:
+        return LIBUSB_ERROR_PIPE;
+    case ENODEV:
+    case ESHUTDOWN:
+        return LIBUSB_ERROR_NO_DEVICE;
+    case EBUSY:
+        return LIBUSB_ERROR_BUSY;
+    case EACCES:
+    case EPERM:
+        return LIBUSB_ERROR_ACCESS;
+    case ENOENT:
+        return LIBUSB_ERROR_NOT_FOUND;
+    case EINVAL:
+        return LIBUSB_ERROR_INVALID_PARAM;
+    case ENOMEM:
+        return LIBUSB_ERROR_NO_MEM;
+    case EOVERFLOW:
+        return LIBUSB_ERROR_OVERFLOW;
+    case EINTR:
+        return LIBUSB_ERROR_INTERRUPTED;
+    default:
+        return LIBUSB_ERROR_IO;
+    }
+}
+
+static unsigned char urbType(int type)
+{
+    return type == LIBUSB_TRANSFER_TYPE_INTERRUPT ? USBDEVFS_URB_TYPE_INTERRUPT : USBDEVFS_URB_TYPE_BULK;
+}
+#else
+struct UsbFs::Urb
+{
+};
+#endif
+
+unsigned char* UsbFs::allocate(std::size_t size, bool &mapped)
+{
+    mapped = false;
+#ifdef __linux__
+    if (canMmap) {
+        /* kernel buffers the controller can dma into directly */
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr != MAP_FAILED) {
+            mapped = true;
+            return static_cast<unsigned char*>(ptr);
+        }
+    }
+#endif
+    return static_cast<unsigned char*>(malloc(size));
+}
+
+void UsbFs::deallocate(unsigned char *buffer, std::size_t size, bool mapped)
+{
+    if (buffer == nullptr) {
+        return;
+    }
+#ifdef __linux__
+    if (mapped) {
+        munmap(buffer, size);
+        return;
+    }
+#endif
+    free(buffer);
+    return;
+}
+
+UsbFs::Urb* UsbFs::newUrb(unsigned char endpoint, int type, std::size_t size, bool isRead)
+{
+#ifdef __linux__
+    Urb *urb = new Urb;
+    memset(&urb->urb, 0, sizeof(usbdevfs_urb));
+    urb->size = size;
+    urb->isRead = isRead;
+    urb->urb.buffer = allocate(size, urb->isMapped);
+    if (urb->urb.buffer == nullptr) {
+        delete urb;
+        return nullptr;
+    }
+    urb->urb.type = urbType(type);
+    urb->urb.endpoint = endpoint;
+    urb->urb.buffer_length = size;
+    urb->urb.stream_id = streamID;
+    urb->urb.usercontext = urb;
+    return urb;
+#else
+    return nullptr;
+#endif
+}
+
+void UsbFs::deleteUrb(UsbFs::Urb *urb)
+{
+#ifdef __linux__
+    deallocate(static_cast<unsigned char*>(urb->urb.buffer), urb->size, urb->isMapped);
+#endif
+    delete urb;
+    return;
+}
+
+int UsbFs::submit(UsbFs::Urb *urb)
+{
+#ifdef __linux__
+    pendingUrbs++;
+    if (ioctl(fd, USBDEVFS_SUBMITURB, &urb->urb) < 0) {
+        pendingUrbs--;
+        return errorCode(errno);
+    }
+    return LIBUSB_SUCCESS;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int UsbFs::complete(UsbFs::Urb *urb, const FnProcess &process, bool resubmit)
+{
+    pendingUrbs--;
+#ifdef __linux__
+    if (!urb->isRead) {
+        deleteUrb(urb);
+        return LIBUSB_SUCCESS;
+    }
+    int status = urb->urb.status;
+    if (status == 0 && urb->urb.actual_length > 0) {
+        process(static_cast<unsigned char*>(urb->urb.buffer), urb->urb.actual_length);
+    }
+    /* only a clean completion goes back out, a stalled or babbling endpoint
+       would otherwise be reaped and resubmitted forever. Failed urbs stay in
+       the ring until stopRing */
+    if (status != 0) {
+        return errorCode(-status);
+    }
+    if (!resubmit) {
+        return LIBUSB_SUCCESS;
+    }
+    urb->urb.actual_length = 0;
+    urb->urb.status = 0;
+    return submit(urb);
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+UsbFs::UsbFs():
+    fd(-1),
+    interfaceNum(-1),
+    canMmap(false),
+    streamID(0),
+    pendingUrbs(0),
+    isRingRunning(false)
+{
+
+}
+
+UsbFs::~UsbFs()
+{
+    close();
+}
+
+bool UsbFs::isSupported()
+{
+#ifdef __linux__
+    return access("/dev/bus/usb", R_OK) == 0;
+#else
+    return false;
+#endif
+}
+
+int UsbFs::open(unsigned char bus, unsigned char address)
+{
+#ifdef __linux__
+    if (fd >= 0) {
+        return LIBUSB_SUCCESS;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u", bus, address);
+    fd = ::open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return errorCode(errno);
+    }
+    unsigned int caps = 0;
+    if (ioctl(fd, USBDEVFS_GET_CAPABILITIES, &caps) == 0) {
+        canMmap = (caps & USBDEVFS_CAP_MMAP) != 0;
+    }
+    return LIBUSB_SUCCESS;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void UsbFs::close()
+{
+#ifdef __linux__
+    if (fd < 0) {
+        return;
+    }
+    int ret = stopRing(0);
+    if (interfaceNum >= 0) {
+        unsigned int num = interfaceNum;
+        ioctl(fd, USBDEVFS_RELEASEINTERFACE, &num);
+        interfaceNum = -1;
+    }
+    ::close(fd);
+    fd = -1;
+    if (ret != LIBUSB_SUCCESS) {
+        /* closing the fd killed what was still in flight, the kernel no
+           longer touches the ring. Unreaped writes are lost with it */
+        for (std::size_t i = 0; i < ring.size(); i++) {
+            deleteUrb(ring[i]);
+        }
+        ring.clear();
+        pendingUrbs = 0;
+    }
+#endif
+    return;
+}
+
+int UsbFs::claim(int interfaceNum_)
+{
+#ifdef __linux__
+    if (fd < 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    /* detach the kernel driver and claim in one step when available */
+    usbdevfs_disconnect_claim dc;
+    memset(&dc, 0, sizeof(dc));
+    dc.interface = interfaceNum_;
+    dc.flags = USBDEVFS_DISCONNECT_CLAIM_EXCEPT_DRIVER;
+    strcpy(dc.driver, "usbfs");
+    if (ioctl(fd, USBDEVFS_DISCONNECT_CLAIM, &dc) < 0) {
+        unsigned int num = interfaceNum_;
+        if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &num) < 0) {
+            return errorCode(errno);
+        }
+    }
+    interfaceNum = interfaceNum_;
+    return LIBUSB_SUCCESS;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int UsbFs::clearHalt(unsigned char endpoint)
+{
+#ifdef __linux__
+    unsigned int ep = endpoint;
+    if (ioctl(fd, USBDEVFS_CLEAR_HALT, &ep) < 0) {
+        return errorCode(errno);
+    }
+    return LIBUSB_SUCCESS;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int UsbFs::transfer(unsigned char endpoint, unsigned char *data, int length,
+                    int *actualLength, unsigned int timeout)
+{
+    *actualLength = 0;
+#ifdef __linux__
+    usbdevfs_bulktransfer bulk;
+    bulk.ep = endpoint;
+    bulk.len = length;
+    bulk.timeout = timeout;
+    bulk.data = data;
+    int ret = ioctl(fd, USBDEVFS_BULK, &bulk);
+    if (ret < 0) {
+        return errorCode(errno);
+    }
+    *actualLength = ret;
+    return LIBUSB_SUCCESS;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int UsbFs::allocStreams(unsigned int num, const std::vector<unsigned char> &endpoints)
+{
+#ifdef __linux__
+    std::vector<unsigned char> buffer(sizeof(usbdevfs_streams) + endpoints.size());
+    usbdevfs_streams *streams = reinterpret_cast<usbdevfs_streams*>(buffer.data());
+    streams->num_streams = num;
+    streams->num_eps = endpoints.size();
+    memcpy(streams->eps, endpoints.data(), endpoints.size());
+    int ret = ioctl(fd, USBDEVFS_ALLOC_STREAMS, streams);
+    if (ret < 0) {
+        return errorCode(errno);
+    }
+    /* number of streams actually allocated */
+    return ret;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int UsbFs::freeStreams(const std::vector<unsigned char> &endpoints)
+{
+#ifdef __linux__
+    std::vector<unsigned char> buffer(sizeof(usbdevfs_streams) + endpoints.size());
+    usbdevfs_streams *streams = reinterpret_cast<usbdevfs_streams*>(buffer.data());
+    streams->num_streams = 0;
+    streams->num_eps = endpoints.size();
+    memcpy(streams->eps, endpoints.data(), endpoints.size());
+    if (ioctl(fd, USBDEVFS_FREE_STREAMS, streams) < 0) {
+        return errorCode(errno);
+    }
+    return LIBUSB_SUCCESS;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int UsbFs::startRing(unsigned char endpoint, int type, std::size_t bufferSize, std::size_t num,
+                     unsigned int streamID_)
+{
+    if (fd < 0 || bufferSize == 0 || num == 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    /* a ring left over by a timed out stop is reused only once it is all back */
+    if (!ring.empty() && (isRingRunning || stopRing(0) != LIBUSB_SUCCESS)) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    streamID = streamID_;
+    for (std::size_t i = 0; i < num; i++) {
+        Urb *urb = newUrb(endpoint, type, bufferSize, true);
+        if (urb == nullptr) {
+            break;
+        }
+        if (submit(urb) != LIBUSB_SUCCESS) {
+            deleteUrb(urb);
+            continue;
+        }
+        ring.push_back(urb);
+    }
+    streamID = 0;
+    if (ring.empty()) {
+        return LIBUSB_ERROR_IO;
+    }
+    std::lock_guard<std::mutex> guard(writeMutex);
+    isRingRunning = true;
+    return LIBUSB_SUCCESS;
+}
+
+int UsbFs::write(unsigned char endpoint, int type, const unsigned char *data, std::size_t size)
+{
+    if (fd < 0 || data == nullptr || size == 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    Urb *urb = newUrb(endpoint, type, size, false);
+    if (urb == nullptr) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+#ifdef __linux__
+    memcpy(urb->urb.buffer, data, size);
+#endif
+    /* checked and submitted under the lock, so stopRing counts every write it has to reap */
+    std::lock_guard<std::mutex> guard(writeMutex);
+    if (!isRingRunning) {
+        deleteUrb(urb);
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    int ret = submit(urb);
+    if (ret != LIBUSB_SUCCESS) {
+        deleteUrb(urb);
+    }
+    return ret;
+}
+
+int UsbFs::pump(const FnProcess &process, int timeout)
+{
+#ifdef __linux__
+    if (fd < 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    /* usbfs signals reapable urbs as writable */
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, timeout);
+    if (ret < 0) {
+        return errno == EINTR ? 0 : errorCode(errno);
+    }
+    if (pfd.revents & (POLLERR | POLLHUP)) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    /* reap the whole batch without sleeping in between */
+    int count = 0;
+    int error = LIBUSB_SUCCESS;
+    for (std::size_t i = 0; i < max_reap_num; i++) {
+        void *context = nullptr;
+        if (ioctl(fd, USBDEVFS_REAPURBNDELAY, &context) < 0) {
+            if (errno == ENODEV) {
+                return LIBUSB_ERROR_NO_DEVICE;
+            }
+            break;
+        }
+        int ret = complete(static_cast<Urb*>(static_cast<usbdevfs_urb*>(context)->usercontext), process, true);
+        if (ret != LIBUSB_SUCCESS && error == LIBUSB_SUCCESS) {
+            error = ret;
+        }
+        count++;
+    }
+    return error != LIBUSB_SUCCESS ? error : count;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int UsbFs::stopRing(int timeout)
+{
+#ifdef __linux__
+    if (fd < 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    {
+        std::lock_guard<std::mutex> guard(writeMutex);
+        isRingRunning = false;
+    }
+    for (std::size_t i = 0; i < ring.size(); i++) {
+        ioctl(fd, USBDEVFS_DISCARDURB, &ring[i]->urb);
+    }
+    /* reap until every urb, reads and writes, is back */
+    FnProcess drop = [](unsigned char*, std::size_t){};
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (pendingUrbs.load() > 0) {
+        void *context = nullptr;
+        if (ioctl(fd, USBDEVFS_REAPURBNDELAY, &context) == 0) {
+            complete(static_cast<Urb*>(static_cast<usbdevfs_urb*>(context)->usercontext), drop, false);
+            continue;
+        }
+        if (errno != EAGAIN || std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        poll(&pfd, 1, 10);
+    }
+    if (pendingUrbs.load() > 0) {
+        /* freeing or resubmitting these now would hand the kernel's urbs back out */
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    for (std::size_t i = 0; i < ring.size(); i++) {
+        deleteUrb(ring[i]);
+    }
+    ring.clear();
+    return LIBUSB_SUCCESS;
+#else
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
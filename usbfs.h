@@ -0,0 +1,66 @@
+#ifndef USBFS_H
+#define USBFS_H
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+
+/* direct linux usbfs access (/dev/bus/usb/BBB/DDD), the alternative to
+   libusb for Usb/UsbAsync. Errors are reported with the libusb codes so
+   both backends share the same handling. Other platforms report
+   LIBUSB_ERROR_NOT_SUPPORTED. */
+class UsbFs
+{
+public:
+    using FnProcess = std::function<void(unsigned char*, std::size_t)>;
+    constexpr static std::size_t max_reap_num = 64;
+    struct Urb;
+protected:
+    int fd;
+    int interfaceNum;
+    bool canMmap;
+    unsigned int streamID;
+    /* read ring, kept after a stopRing that timed out since the kernel
+       still owns some of its urbs, startRing refuses until they are reaped */
+    std::vector<Urb*> ring;
+    std::atomic<int> pendingUrbs;
+    /* writes are only reaped by the ring's pump, so they need a running ring */
+    std::mutex writeMutex;
+    bool isRingRunning;
+protected:
+    unsigned char* allocate(std::size_t size, bool &mapped);
+    void deallocate(unsigned char *buffer, std::size_t size, bool mapped);
+    Urb* newUrb(unsigned char endpoint, int type, std::size_t size, bool isRead);
+    void deleteUrb(Urb *urb);
+    int submit(Urb *urb);
+    int complete(Urb *urb, const FnProcess &process, bool resubmit);
+public:
+    UsbFs();
+    ~UsbFs();
+    static bool isSupported();
+    bool isOpen() const {return fd >= 0;}
+    int open(unsigned char bus, unsigned char address);
+    void close();
+    int claim(int interfaceNum_);
+    int clearHalt(unsigned char endpoint);
+    /* sync bulk or interrupt */
+    int transfer(unsigned char endpoint, unsigned char *data, int length,
+                 int *actualLength, unsigned int timeout);
+    /* bulk streams on superspeed endpoints, streamID goes into every urb */
+    int allocStreams(unsigned int num, const std::vector<unsigned char> &endpoints);
+    int freeStreams(const std::vector<unsigned char> &endpoints);
+    /* async: a read ring of urbs, copied writes, and a pump that reaps
+       every finished urb in one batch */
+    int startRing(unsigned char endpoint, int type, std::size_t bufferSize, std::size_t num,
+                  unsigned int streamID_ = 0);
+    /* copied into its own urb, refused unless startRing is running */
+    int write(unsigned char endpoint, int type, const unsigned char *data, std::size_t size);
+    /* reaped urb count, or the error of the first read urb that failed and
+       was not resubmitted, the ring should be stopped then */
+    int pump(const FnProcess &process, int timeout);
+    /* LIBUSB_ERROR_TIMEOUT when urbs are still in flight after timeout ms,
+       calling it again carries on reaping */
+    int stopRing(int timeout);
+};
+
+#endif // USBFS_H
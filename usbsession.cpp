@@ -0,0 +1,152 @@
+#include "usbsession.h"
+
+void UsbSession::onAttach()
+{
+    post(HOTPLUG_ATTACH);
+    return;
+}
+
+void UsbSession::onDetach()
+{
+    post(HOTPLUG_DETACH);
+    return;
+}
+
+void UsbSession::post(int event)
+{
+    std::unique_lock<std::mutex> locker(sessionMutex);
+    events.push_back(event);
+    sessionCondit.notify_all();
+    return;
+}
+
+void UsbSession::run()
+{
+    while (1) {
+        int event = HOTPLUG_TERMINATE;
+        {
+            std::unique_lock<std::mutex> locker(sessionMutex);
+            sessionCondit.wait(locker, [this]()->bool{
+                                   return !events.empty();
+                               });
+            event = events.front();
+            events.pop_front();
+        }
+        if (event == HOTPLUG_TERMINATE) {
+            break;
+        } else if (event == HOTPLUG_ATTACH) {
+            resume();
+        } else if (event == HOTPLUG_DETACH) {
+            suspend();
+        }
+    }
+    suspend();
+    return;
+}
+
+int UsbSession::resume()
+{
+    if (isAttached.load()) {
+        return USB_SUCCESS;
+    }
+    /* reopens and reclaims the interface */
+    int ret = _openDevice();
+    if (ret != USB_SUCCESS) {
+        return ret;
+    }
+    ret = startRecv();
+    if (ret != USB_SUCCESS) {
+        closeDevice();
+        return ret;
+    }
+    isAttached.store(true);
+    flush();
+    return USB_SUCCESS;
+}
+
+void UsbSession::suspend()
+{
+    if (!isAttached.exchange(false)) {
+        return;
+    }
+    /* cancel the read ring and wait for every transfer to come back
+       before the handle goes away */
+    stopRecv();
+    drainRequests(timeout_duration);
+    closeDevice();
+    return;
+}
+
+void UsbSession::flush()
+{
+    while (isAttached.load()) {
+        std::vector<unsigned char> data;
+        {
+            std::unique_lock<std::mutex> locker(sessionMutex);
+            if (queuedWrites.empty()) {
+                break;
+            }
+            data.swap(queuedWrites.front());
+            queuedWrites.pop_front();
+        }
+        if (UsbAsync::write(data) != USB_SUCCESS) {
+            std::unique_lock<std::mutex> locker(sessionMutex);
+            queuedWrites.push_front(data);
+            break;
+        }
+    }
+    return;
+}
+
+UsbSession::UsbSession():
+    isAttached(false)
+{
+
+}
+
+UsbSession::~UsbSession()
+{
+    stopSession();
+}
+
+int UsbSession::startSession(unsigned short vendorID, unsigned short productID)
+{
+    if (sessionThread.joinable()) {
+        return USB_SUCCESS;
+    }
+    property.vendorID = vendorID;
+    property.productID = productID;
+    registerAttach();
+    registerDetach();
+    startHandleEvent();
+    int ret = resume();
+    sessionThread = std::thread(&UsbSession::run, this);
+    return ret;
+}
+
+void UsbSession::stopSession()
+{
+    if (!sessionThread.joinable()) {
+        return;
+    }
+    deregisterHotplug();
+    post(HOTPLUG_TERMINATE);
+    sessionThread.join();
+    return;
+}
+
+int UsbSession::write(const std::vector<unsigned char> &data)
+{
+    if (data.empty()) {
+        return USB_INVALID_PARAM;
+    }
+    if (isAttached.load() && UsbAsync::write(data) == USB_SUCCESS) {
+        return USB_SUCCESS;
+    }
+    std::unique_lock<std::mutex> locker(sessionMutex);
+    if (queuedWrites.size() >= max_queued_write) {
+        return USB_TRANSFER_ERROR;
+    }
+    queuedWrites.push_back(data);
+    return USB_SUCCESS;
+}
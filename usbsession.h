@@ -0,0 +1,49 @@
+#ifndef USBSESSION_H
+#define USBSESSION_H
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "usbasync.h"
+
+/* UsbAsync that survives unplug: hotplug events are handled off the event
+   thread, the read ring is drained on detach and restarted on attach, and
+   writes issued while detached are queued and flushed on reconnect */
+class UsbSession : public UsbAsync
+{
+public:
+    enum Hotplug {
+        HOTPLUG_ATTACH = 0,
+        HOTPLUG_DETACH,
+        HOTPLUG_TERMINATE
+    };
+    constexpr static std::size_t max_queued_write = 256;
+protected:
+    std::thread sessionThread;
+    std::mutex sessionMutex;
+    std::condition_variable sessionCondit;
+    std::deque<int> events;
+    std::deque<std::vector<unsigned char> > queuedWrites;
+    std::atomic_bool isAttached;
+protected:
+    void onAttach() override;
+    void onDetach() override;
+    void post(int event);
+    void run();
+    int resume();
+    void suspend();
+    void flush();
+public:
+    UsbSession();
+    ~UsbSession();
+    /* returns the result of the first open, the session keeps waiting for
+       the device either way */
+    int startSession(unsigned short vendorID, unsigned short productID);
+    void stopSession();
+    bool attached() const {return isAttached.load();}
+    using UsbAsync::write;
+    int write(const std::vector<unsigned char> &data);
+};
+
+#endif // USBSESSION_H
@@ -0,0 +1,234 @@
+#include "usbtransaction.h"
+#include <future>
+
+/* the device's process callback goes through here. Replacing the callback
+   on destruction would race the event thread running it, so the destructor
+   disarms the receiver under its lock instead, after any receive in progress */
+struct UsbTransaction::Receiver
+{
+    std::mutex mutex;
+    UsbTransaction *transaction;
+};
+
+/* set on threads that deliver responses, waiting there for a free slot
+   would block the very responses that free it */
+static thread_local bool g_isDelivering = false;
+
+void UsbTransaction::receive(unsigned char *data, std::size_t size)
+{
+    unsigned int seq = 0;
+    if (!match(data, size, seq)) {
+        unsolicited(data, size);
+        return;
+    }
+    FnResponse response;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = inflight.find(seq);
+        if (it == inflight.end()) {
+            /* late response to an expired request */
+            return;
+        }
+        response = it->second.response;
+        inflight.erase(it);
+    }
+    condit.notify_all();
+    response(TRANSACTION_SUCCESS, data, size);
+    return;
+}
+
+void UsbTransaction::expire()
+{
+    g_isDelivering = true;
+    while (1) {
+        std::vector<FnResponse> expired;
+        {
+            std::unique_lock<std::mutex> locker(mutex);
+            if (!isRunning) {
+                break;
+            }
+            if (inflight.empty()) {
+                condit.wait(locker);
+                continue;
+            }
+            Clock::time_point deadline = inflight.begin()->second.deadline;
+            for (auto &x : inflight) {
+                if (x.second.deadline < deadline) {
+                    deadline = x.second.deadline;
+                }
+            }
+            if (Clock::now() < deadline) {
+                condit.wait_until(locker, deadline);
+                continue;
+            }
+            Clock::time_point now = Clock::now();
+            for (auto it = inflight.begin(); it != inflight.end();) {
+                if (it->second.deadline <= now) {
+                    expired.push_back(it->second.response);
+                    it = inflight.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        condit.notify_all();
+        for (auto &response : expired) {
+            response(TRANSACTION_TIMEOUT, nullptr, 0);
+        }
+    }
+    return;
+}
+
+UsbTransaction::UsbTransaction(UsbAsync &device_, std::size_t maxInflight_,
+                               const Framer::Config &frame):
+    device(device_),
+    framer(frame),
+    maxInflight(maxInflight_ == 0 ? 1 : maxInflight_),
+    sequence(0),
+    isRunning(true)
+{
+    tag = &UsbTransaction::defaultTag;
+    match = &UsbTransaction::defaultMatch;
+    unsolicited = [](unsigned char*, std::size_t){};
+    framer.registerFrame([this](unsigned char *data, std::size_t size) {
+        receive(data, size);
+    });
+    receiver = std::make_shared<Receiver>();
+    receiver->transaction = this;
+    isAttached = !device.isReceiving();
+    if (isAttached) {
+        std::shared_ptr<Receiver> receiver_ = receiver;
+        device.registerProcess([receiver_](unsigned char *data, std::size_t size) {
+            std::lock_guard<std::mutex> guard(receiver_->mutex);
+            if (receiver_->transaction != nullptr) {
+                g_isDelivering = true;
+                receiver_->transaction->framer.push(data, size);
+                g_isDelivering = false;
+            }
+        });
+    }
+    timeoutThread = std::thread(&UsbTransaction::expire, this);
+}
+
+UsbTransaction::~UsbTransaction()
+{
+    {
+        std::lock_guard<std::mutex> guard(receiver->mutex);
+        receiver->transaction = nullptr;
+    }
+    cancelAll();
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        isRunning = false;
+    }
+    condit.notify_all();
+    timeoutThread.join();
+}
+
+void UsbTransaction::defaultTag(unsigned int seq, std::vector<unsigned char> &request)
+{
+    /* little endian sequence id in front of the payload */
+    unsigned char header[seq_size];
+    for (std::size_t i = 0; i < seq_size; i++) {
+        header[i] = (seq >> (8*i)) & 0xff;
+    }
+    request.insert(request.begin(), header, header + seq_size);
+    std::size_t length = request.size();
+    unsigned char prefix[2] = {(unsigned char)(length & 0xff), (unsigned char)((length >> 8) & 0xff)};
+    request.insert(request.begin(), prefix, prefix + 2);
+    return;
+}
+
+bool UsbTransaction::defaultMatch(const unsigned char *data, std::size_t size, unsigned int &seq)
+{
+    if (size < seq_size) {
+        return false;
+    }
+    seq = 0;
+    for (std::size_t i = 0; i < seq_size; i++) {
+        seq |= (unsigned int)data[i] << (8*i);
+    }
+    return true;
+}
+
+int UsbTransaction::submit(const unsigned char *data, std::size_t size,
+                           const FnResponse &response, int timeout)
+{
+    if (!isAttached || data == nullptr || size == 0) {
+        return TRANSACTION_INVALID_PARAM;
+    }
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout);
+    std::vector<unsigned char> request(data, data + size);
+    unsigned int seq = 0;
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        if (g_isDelivering && inflight.size() >= maxInflight) {
+            return TRANSACTION_BUSY;
+        }
+        bool ready = condit.wait_until(locker, deadline, [this]()->bool{
+                                           return inflight.size() < maxInflight;
+                                       });
+        if (!ready) {
+            return TRANSACTION_TIMEOUT;
+        }
+        seq = sequence++;
+        Request &req = inflight[seq];
+        req.response = response;
+        req.deadline = deadline;
+    }
+    /* wake the timeout thread for the new deadline */
+    condit.notify_all();
+    tag(seq, request);
+    int ret = device.write(request);
+    if (ret != Usb::USB_SUCCESS) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            inflight.erase(seq);
+        }
+        /* a submitter may be waiting for this slot */
+        condit.notify_all();
+        return TRANSACTION_SEND_FAILED;
+    }
+    return TRANSACTION_SUCCESS;
+}
+
+int UsbTransaction::call(const unsigned char *data, std::size_t size,
+                         std::vector<unsigned char> &response, int timeout)
+{
+    /* the response would have to come through the thread blocked here */
+    if (g_isDelivering) {
+        return TRANSACTION_BUSY;
+    }
+    std::shared_ptr<std::promise<int> > result = std::make_shared<std::promise<int> >();
+    std::future<int> future = result->get_future();
+    int ret = submit(data, size, [result, &response](int code, const unsigned char *resp, std::size_t len) {
+        if (code == TRANSACTION_SUCCESS) {
+            response.assign(resp, resp + len);
+        }
+        result->set_value(code);
+    }, timeout);
+    if (ret != TRANSACTION_SUCCESS) {
+        return ret;
+    }
+    return future.get();
+}
+
+std::size_t UsbTransaction::pending()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    return inflight.size();
+}
+
+void UsbTransaction::cancelAll()
+{
+    std::map<unsigned int, Request> cancelled;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        cancelled.swap(inflight);
+    }
+    condit.notify_all();
+    for (auto &x : cancelled) {
+        x.second.response(TRANSACTION_CANCELLED, nullptr, 0);
+    }
+    return;
+}
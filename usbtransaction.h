@@ -0,0 +1,94 @@
+#ifndef USBTRANSACTION_H
+#define USBTRANSACTION_H
+#include <map>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include "usbasync.h"
+#include "framer.h"
+
+/* command/response layer on top of the UsbAsync read pipeline. Received
+   bytes are reassembled by a Framer first, a transfer may carry part of a
+   response or several of them, and matching only ever sees whole frames */
+class UsbTransaction
+{
+public:
+    enum Code {
+        TRANSACTION_SUCCESS = 0,
+        TRANSACTION_INVALID_PARAM,
+        TRANSACTION_SEND_FAILED,
+        TRANSACTION_TIMEOUT,
+        TRANSACTION_CANCELLED,
+        /* window full while called from a response or receive callback */
+        TRANSACTION_BUSY
+    };
+    using FnResponse = std::function<void(int, const unsigned char*, std::size_t)>;
+    /* write the sequence id into an outgoing request */
+    using FnTag = std::function<void(unsigned int, std::vector<unsigned char>&)>;
+    /* read the sequence id back from a response, false if it is not one */
+    using FnMatch = std::function<bool(const unsigned char*, std::size_t, unsigned int&)>;
+    using FnProcess = UsbAsync::FnProcess;
+    using Clock = std::chrono::steady_clock;
+    constexpr static std::size_t max_inflight = 16;
+    constexpr static std::size_t seq_size = 4;
+protected:
+    struct Request
+    {
+        FnResponse response;
+        Clock::time_point deadline;
+    };
+    struct Receiver;
+    UsbAsync &device;
+    /* shared with the device's process callback, outlives this object */
+    std::shared_ptr<Receiver> receiver;
+    /* only fed under the receiver lock */
+    Framer framer;
+    /* false when the device was already receiving at construction */
+    bool isAttached;
+    std::size_t maxInflight;
+    unsigned int sequence;
+    std::map<unsigned int, Request> inflight;
+    std::mutex mutex;
+    std::condition_variable condit;
+    bool isRunning;
+    std::thread timeoutThread;
+    FnTag tag;
+    FnMatch match;
+    FnProcess unsolicited;
+protected:
+    void receive(unsigned char *data, std::size_t size);
+    void expire();
+public:
+    /* construct before device.start(), the read ring calls the process
+       callback without a lock. On a running device nothing is registered
+       and submit fails with TRANSACTION_INVALID_PARAM */
+    explicit UsbTransaction(UsbAsync &device_, std::size_t maxInflight_ = max_inflight,
+                            const Framer::Config &frame = Framer::Config());
+    bool attached() const {return isAttached;}
+    /* waits for a response being delivered, so not from inside a response callback */
+    ~UsbTransaction();
+    /* frames the request for the default Framer::Config: 2 byte little endian
+       length, then the sequence id, then the payload */
+    static void defaultTag(unsigned int seq, std::vector<unsigned char> &request);
+    /* the sequence id at the start of a frame, the prefix is already stripped */
+    static bool defaultMatch(const unsigned char *data, std::size_t size, unsigned int &seq);
+    void registerTag(const FnTag &func) {tag = func;}
+    void registerMatch(const FnMatch &func) {match = func;}
+    void registerUnsolicited(const FnProcess &func) {unsolicited = func;}
+    /* async, blocks while maxInflight requests are outstanding. From a
+       callback it cannot wait for the responses it would block, so a full
+       window returns TRANSACTION_BUSY instead */
+    int submit(const unsigned char *data, std::size_t size,
+               const FnResponse &response, int timeout = Usb::timeout_duration);
+    /* sync, TRANSACTION_BUSY from a callback */
+    int call(const unsigned char *data, std::size_t size,
+             std::vector<unsigned char> &response, int timeout = Usb::timeout_duration);
+    std::size_t pending();
+    void cancelAll();
+};
+
+#endif // USBTRANSACTION_H
@@ -0,0 +1,185 @@
+#ifndef USBTRANSFER_H
+#define USBTRANSFER_H
+#include "usb.h"
+
+/* transfer traits, one specialization per libusb transfer type */
+template<>
+struct Usb::Transfer<LIBUSB_TRANSFER_TYPE_BULK>
+{
+    constexpr static int iso_packet_num = 0;
+    static int sync(libusb_device_handle *handle, unsigned char endpoint,
+                    unsigned char *data, int length, int *actualLength, unsigned int timeout)
+    {
+        return libusb_bulk_transfer(handle, endpoint, data, length, actualLength, timeout);
+    }
+    static std::size_t length(libusb_device_handle*, unsigned char, std::size_t bufferSize)
+    {
+        return bufferSize;
+    }
+    static void fill(libusb_transfer *transfer, libusb_device_handle *handle, unsigned char endpoint,
+                     unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+                     void *userdata, unsigned int timeout)
+    {
+        libusb_fill_bulk_transfer(transfer, handle, endpoint, buffer, length, callback, userdata, timeout);
+    }
+    template<typename Fn>
+    static void deliver(libusb_transfer *transfer, Fn &fn)
+    {
+        if (transfer->actual_length > 0) {
+            fn(transfer->buffer, transfer->actual_length);
+        }
+    }
+};
+
+template<>
+struct Usb::Transfer<LIBUSB_TRANSFER_TYPE_INTERRUPT>
+{
+    constexpr static int iso_packet_num = 0;
+    static int sync(libusb_device_handle *handle, unsigned char endpoint,
+                    unsigned char *data, int length, int *actualLength, unsigned int timeout)
+    {
+        return libusb_interrupt_transfer(handle, endpoint, data, length, actualLength, timeout);
+    }
+    static std::size_t length(libusb_device_handle*, unsigned char, std::size_t bufferSize)
+    {
+        return bufferSize;
+    }
+    static void fill(libusb_transfer *transfer, libusb_device_handle *handle, unsigned char endpoint,
+                     unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+                     void *userdata, unsigned int timeout)
+    {
+        libusb_fill_interrupt_transfer(transfer, handle, endpoint, buffer, length, callback, userdata, timeout);
+    }
+    template<typename Fn>
+    static void deliver(libusb_transfer *transfer, Fn &fn)
+    {
+        if (transfer->actual_length > 0) {
+            fn(transfer->buffer, transfer->actual_length);
+        }
+    }
+};
+
+template<>
+struct Usb::Transfer<LIBUSB_TRANSFER_TYPE_ISOCHRONOUS>
+{
+    constexpr static int iso_packet_num = 8;
+    /* libusb has no synchronous isochronous transfer */
+    static std::size_t length(libusb_device_handle *handle, unsigned char endpoint, std::size_t bufferSize)
+    {
+        int packetSize = libusb_get_max_iso_packet_size(libusb_get_device(handle), endpoint);
+        if (packetSize <= 0) {
+            return bufferSize;
+        }
+        return std::size_t(packetSize)*iso_packet_num;
+    }
+    static void fill(libusb_transfer *transfer, libusb_device_handle *handle, unsigned char endpoint,
+                     unsigned char *buffer, int length, libusb_transfer_cb_fn callback,
+                     void *userdata, unsigned int timeout)
+    {
+        libusb_fill_iso_transfer(transfer, handle, endpoint, buffer, length,
+                                 iso_packet_num, callback, userdata, timeout);
+        /* length is at most max packet size x iso_packet_num, so rounding up
+           never exceeds the packet size and the tail packets take the rest */
+        int packet = (length + iso_packet_num - 1)/iso_packet_num;
+        int remain = length;
+        for (int i = 0; i < iso_packet_num; i++) {
+            transfer->iso_packet_desc[i].length = remain < packet ? remain : packet;
+            remain -= transfer->iso_packet_desc[i].length;
+        }
+    }
+    template<typename Fn>
+    static void deliver(libusb_transfer *transfer, Fn &fn)
+    {
+        for (int i = 0; i < transfer->num_iso_packets; i++) {
+            const libusb_iso_packet_descriptor &packet = transfer->iso_packet_desc[i];
+            if (packet.status == LIBUSB_TRANSFER_COMPLETED && packet.actual_length > 0) {
+                fn(libusb_get_iso_packet_buffer_simple(transfer, i), packet.actual_length);
+            }
+        }
+    }
+};
+
+template<int type, int direction, typename RetryPolicy, typename ChunkPolicy>
+int Usb::transfer(unsigned char *data, std::size_t size, const Policy &policy, std::size_t *transferred)
+{
+    static_assert(type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS,
+                  "libusb has no synchronous isochronous transfer");
+    if (transferred != nullptr) {
+        *transferred = 0;
+    }
+    /* the reference keeps the handle open even if the device is closed meanwhile */
+    DevicePtr dev = acquire();
+    if (dev == nullptr || data == nullptr) {
+        return USB_INVALID_PARAM;
+    }
+    const unsigned char endpoint = direction == LIBUSB_ENDPOINT_IN ?
+                dev->inEndpoint : dev->outEndpoint;
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(policy.deadline);
+    const int attempts = RetryPolicy::enabled && policy.retryCount > 0 ? policy.retryCount : 1;
+    std::size_t pos = 0;
+    int ret = LIBUSB_SUCCESS;
+    do {
+        std::size_t length = size - pos;
+        if (ChunkPolicy::size > 0 && length > ChunkPolicy::size) {
+            length = ChunkPolicy::size;
+        }
+        int actualSize = 0;
+        int backoff = policy.backoff;
+        for (int i = 0; i < attempts; i++) {
+            int timeout = policy.timeout;
+            if (policy.deadline > 0) {
+                long long remain = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - Clock::now()).count();
+                if (remain <= 0) {
+                    ret = LIBUSB_ERROR_TIMEOUT;
+                    break;
+                }
+                if (timeout == 0 || remain < timeout) {
+                    timeout = int(remain);
+                }
+            }
+            int n = 0;
+            if (dev->backend == BACKEND_USBFS) {
+                ret = dev->usbfs.transfer(endpoint, data + pos + actualSize,
+                                          int(length - actualSize), &n, timeout);
+            } else {
+                ret = Transfer<type>::sync(dev->handle, endpoint, data + pos + actualSize,
+                                           int(length - actualSize), &n, timeout);
+            }
+            /* keep what made it through before a stall or timeout */
+            actualSize += n;
+            if (ret != LIBUSB_ERROR_PIPE || i == attempts - 1) {
+                break;
+            }
+            if (policy.clearHalt) {
+                if (dev->backend == BACKEND_USBFS) {
+                    dev->usbfs.clearHalt(endpoint);
+                } else {
+                    libusb_clear_halt(dev->handle, endpoint);
+                }
+            }
+            if (backoff > 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(backoff));
+                backoff *= 2;
+            }
+        }
+        pos += actualSize;
+        /* a short packet ends an IN transfer */
+        if (ret != LIBUSB_SUCCESS || std::size_t(actualSize) < length) {
+            break;
+        }
+    } while (pos < size);
+    if (transferred != nullptr) {
+        *transferred = pos;
+    }
+    if (ret == LIBUSB_ERROR_TIMEOUT) {
+        return USB_TIMEOUT;
+    } else if (ret != LIBUSB_SUCCESS) {
+        LOG_INFO("fail to transfer", ret);
+        return USB_TRANSFER_ERROR;
+    }
+    return USB_SUCCESS;
+}
+
+#endif // USBTRANSFER_H
@@ -0,0 +1,337 @@
+#include "virtualhid.h"
+#include <cstring>
+#include <chrono>
+#include <cstddef>
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+#endif
+
+static std::uint64_t steadyNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int VirtualHid::send(const void *event, std::size_t size)
+{
+#ifdef __linux__
+    /* uhid accepts events cut right after their payload */
+    ssize_t ret = ::write(fd, event, size);
+    if (ret < 0 || std::size_t(ret) != size) {
+        return VHID_WRITE_FAILED;
+    }
+    return VHID_SUCCESS;
+#else
+    return VHID_UNSUPPORT;
+#endif
+}
+
+void VirtualHid::handleEvent()
+{
+#ifdef __linux__
+    struct uhid_event event;
+    while (isRunning.load()) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, poll_timeout);
+        if (ret <= 0) {
+            continue;
+        }
+        if (::read(fd, &event, sizeof(event)) <= 0) {
+            continue;
+        }
+        switch (event.type) {
+        case UHID_OPEN:
+            isOpened = true;
+            break;
+        case UHID_CLOSE:
+        case UHID_STOP:
+            isOpened = false;
+            break;
+        case UHID_OUTPUT:
+            outputs++;
+            break;
+        case UHID_GET_REPORT: {
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_GET_REPORT_REPLY;
+            reply.u.get_report_reply.id = event.u.get_report.id;
+            reply.u.get_report_reply.err = 0;
+            reply.u.get_report_reply.size = featureReport.size();
+            memcpy(reply.u.get_report_reply.data, featureReport.data(), featureReport.size());
+            send(&reply, sizeof(reply));
+            break;
+        }
+        case UHID_SET_REPORT: {
+            /* feature reports written by the host are read back on get */
+            std::size_t size = event.u.set_report.size;
+            featureReport.assign(event.u.set_report.data, event.u.set_report.data + size);
+            struct uhid_event reply;
+            memset(&reply, 0, sizeof(reply));
+            reply.type = UHID_SET_REPORT_REPLY;
+            reply.u.set_report_reply.id = event.u.set_report.id;
+            reply.u.set_report_reply.err = 0;
+            send(&reply, sizeof(reply));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+#endif
+    return;
+}
+
+void VirtualHid::generate()
+{
+    std::vector<unsigned char> report(reportSize, 0);
+    std::chrono::nanoseconds period(1000000000ULL/rate);
+    std::uint32_t seq = 0;
+    auto next = std::chrono::steady_clock::now();
+    while (isGenerating.load()) {
+        if (!isOpened.load()) {
+            /* nobody reads yet, the kernel would drop the reports */
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            next = std::chrono::steady_clock::now();
+            continue;
+        }
+        std::uint64_t t = steadyNow();
+        for (std::size_t i = 0; i < 4; i++) {
+            report[i] = (seq >> (8*i)) & 0xff;
+        }
+        for (std::size_t i = 0; i < 8; i++) {
+            report[4 + i] = (t >> (8*i)) & 0xff;
+        }
+        if (input(report.data(), report.size()) == VHID_SUCCESS) {
+            seq++;
+            sent++;
+        }
+        /* fall behind and the next reports go out back-to-back */
+        next += period;
+        std::this_thread::sleep_until(next);
+    }
+    return;
+}
+
+VirtualHid::VirtualHid():
+    fd(-1),
+    reportSize(default_report_size),
+    rate(0),
+    isRunning(false),
+    isGenerating(false),
+    isOpened(false),
+    sent(0),
+    outputs(0),
+    nextSeq(0)
+{
+
+}
+
+VirtualHid::~VirtualHid()
+{
+    destroy();
+}
+
+bool VirtualHid::isSupported()
+{
+#ifdef __linux__
+    return access("/dev/uhid", R_OK | W_OK) == 0;
+#else
+    return false;
+#endif
+}
+
+std::vector<unsigned char> VirtualHid::vendorDescriptor(unsigned short usagePage, unsigned short usage,
+                                                       std::size_t reportSize)
+{
+    std::vector<unsigned char> descriptor = {
+        0x06, (unsigned char)(usagePage & 0xff), (unsigned char)(usagePage >> 8),
+        0x0a, (unsigned char)(usage & 0xff), (unsigned char)(usage >> 8),
+        0xa1, 0x01,
+        0x15, 0x00,
+        0x26, 0xff, 0x00,
+        0x75, 0x08,
+        0x96, (unsigned char)(reportSize & 0xff), (unsigned char)(reportSize >> 8)
+    };
+    /* input, output, feature */
+    const unsigned char mains[3] = {0x81, 0x91, 0xb1};
+    for (int i = 0; i < 3; i++) {
+        descriptor.push_back(0x09);
+        descriptor.push_back(i + 1);
+        descriptor.push_back(mains[i]);
+        descriptor.push_back(0x02);
+    }
+    descriptor.push_back(0xc0);
+    return descriptor;
+}
+
+int VirtualHid::create(const std::string &name, unsigned short vid, unsigned short pid,
+                       const std::vector<unsigned char> &descriptor, std::size_t reportSize_)
+{
+#ifdef __linux__
+    if (fd >= 0 || descriptor.empty() || descriptor.size() > HID_MAX_DESCRIPTOR_SIZE ||
+            reportSize_ < header_size || reportSize_ > UHID_DATA_MAX) {
+        return VHID_INVALID_PARAM;
+    }
+    fd = ::open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return VHID_OPEN_FAILED;
+    }
+    struct uhid_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = UHID_CREATE2;
+    strncpy(reinterpret_cast<char*>(event.u.create2.name), name.c_str(), sizeof(event.u.create2.name) - 1);
+    event.u.create2.rd_size = descriptor.size();
+    event.u.create2.bus = 0x03;
+    event.u.create2.vendor = vid;
+    event.u.create2.product = pid;
+    memcpy(event.u.create2.rd_data, descriptor.data(), descriptor.size());
+    if (send(&event, sizeof(event)) != VHID_SUCCESS) {
+        ::close(fd);
+        fd = -1;
+        return VHID_OPEN_FAILED;
+    }
+    reportSize = reportSize_;
+    featureReport.assign(reportSize, 0);
+    isRunning = true;
+    eventThread = std::thread(&VirtualHid::handleEvent, this);
+    return VHID_SUCCESS;
+#else
+    return VHID_UNSUPPORT;
+#endif
+}
+
+void VirtualHid::destroy()
+{
+#ifdef __linux__
+    if (fd < 0) {
+        return;
+    }
+    stopReports();
+    isRunning = false;
+    if (eventThread.joinable()) {
+        eventThread.join();
+    }
+    struct uhid_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = UHID_DESTROY;
+    send(&event, sizeof(event.type));
+    ::close(fd);
+    fd = -1;
+    isOpened = false;
+#endif
+    return;
+}
+
+int VirtualHid::input(const unsigned char *data, std::size_t size)
+{
+#ifdef __linux__
+    if (fd < 0 || data == nullptr) {
+        return VHID_INVALID_PARAM;
+    }
+    struct uhid_event event;
+    event.type = UHID_INPUT2;
+    event.u.input2.size = reportSize;
+    std::size_t len = size < reportSize ? size : reportSize;
+    memcpy(event.u.input2.data, data, len);
+    memset(event.u.input2.data + len, 0, reportSize - len);
+    return send(&event, offsetof(struct uhid_event, u.input2.data) + reportSize);
+#else
+    return VHID_UNSUPPORT;
+#endif
+}
+
+int VirtualHid::startReports(unsigned int rate_)
+{
+    if (fd < 0 || rate_ == 0 || reportThread.joinable()) {
+        return VHID_INVALID_PARAM;
+    }
+    rate = rate_;
+    {
+        /* the generator counts from zero again */
+        std::lock_guard<std::mutex> guard(statsMutex);
+        nextSeq = 0;
+    }
+    isGenerating = true;
+    reportThread = std::thread(&VirtualHid::generate, this);
+    return VHID_SUCCESS;
+}
+
+void VirtualHid::stopReports()
+{
+    if (!reportThread.joinable()) {
+        return;
+    }
+    isGenerating = false;
+    reportThread.join();
+    return;
+}
+
+void VirtualHid::check(const unsigned char *data, std::size_t size)
+{
+    if (data == nullptr || size < header_size) {
+        return;
+    }
+    double latency = VirtualHid::latency(data, size);
+    std::uint32_t seq = 0;
+    for (std::size_t i = 0; i < 4; i++) {
+        seq |= std::uint32_t(data[i]) << (8*i);
+    }
+    std::lock_guard<std::mutex> guard(statsMutex);
+    /* wrap safe, a report older than nextSeq is late, not a gap */
+    std::int32_t gap = std::int32_t(seq - nextSeq);
+    if (gap > 0) {
+        stats.lost += std::uint32_t(gap);
+    }
+    if (gap >= 0) {
+        nextSeq = seq + 1;
+    }
+    if (stats.received == 0 || latency < stats.latencyMin) {
+        stats.latencyMin = latency;
+    }
+    if (latency > stats.latencyMax) {
+        stats.latencyMax = latency;
+    }
+    stats.latencyTotal += latency;
+    stats.received++;
+    stats.bytes += size;
+    return;
+}
+
+double VirtualHid::latency(const unsigned char *data, std::size_t size)
+{
+    if (data == nullptr || size < header_size) {
+        return -1;
+    }
+    std::uint64_t now = steadyNow();
+    std::uint64_t t = 0;
+    for (std::size_t i = 0; i < 8; i++) {
+        t |= std::uint64_t(data[4 + i]) << (8*i);
+    }
+    return double(now - t)/1000.0;
+}
+
+VirtualHid::Stats VirtualHid::getStats()
+{
+    std::lock_guard<std::mutex> guard(statsMutex);
+    Stats s = stats;
+    s.sent = sent.load();
+    s.outputs = outputs.load();
+    return s;
+}
+
+void VirtualHid::resetStats()
+{
+    std::lock_guard<std::mutex> guard(statsMutex);
+    stats = Stats();
+    nextSeq = 0;
+    sent = 0;
+    outputs = 0;
+    return;
+}
@@ -0,0 +1,89 @@
+#ifndef VIRTUALHID_H
+#define VIRTUALHID_H
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+/* virtual hid device through linux /dev/uhid for load testing Hid without
+   hardware. Input reports carry a sequence number and a send timestamp so
+   the receiving side can measure throughput, latency and drops. */
+class VirtualHid
+{
+public:
+    enum Code {
+        VHID_SUCCESS = 0,
+        VHID_INVALID_PARAM,
+        VHID_OPEN_FAILED,
+        VHID_WRITE_FAILED,
+        VHID_UNSUPPORT
+    };
+    struct Stats
+    {
+        std::uint64_t sent;
+        std::uint64_t received;
+        std::uint64_t lost;
+        std::uint64_t bytes;
+        /* output reports written to the device by the host side */
+        std::uint64_t outputs;
+        /* send to delivery latency in microseconds */
+        double latencyMin;
+        double latencyMax;
+        double latencyTotal;
+        Stats():sent(0), received(0), lost(0), bytes(0), outputs(0),
+            latencyMin(0), latencyMax(0), latencyTotal(0){}
+        double latencyMean() const {return received == 0 ? 0 : latencyTotal/received;}
+        double dropRate() const {return sent == 0 ? 0 : double(lost)/sent;}
+    };
+    /* sequence number and timestamp at the start of every input report */
+    constexpr static std::size_t header_size = 12;
+    constexpr static std::size_t default_report_size = 64;
+    constexpr static int poll_timeout = 100;
+protected:
+    int fd;
+    std::size_t reportSize;
+    unsigned int rate;
+    std::atomic_bool isRunning;
+    std::atomic_bool isGenerating;
+    std::atomic_bool isOpened;
+    std::thread eventThread;
+    std::thread reportThread;
+    std::vector<unsigned char> featureReport;
+    /* counters */
+    std::atomic<std::uint64_t> sent;
+    std::atomic<std::uint64_t> outputs;
+    std::mutex statsMutex;
+    /* sequence expected next, wraps with the 32 bit stamp */
+    std::uint32_t nextSeq;
+    Stats stats;
+protected:
+    int send(const void *event, std::size_t size);
+    void handleEvent();
+    void generate();
+public:
+    VirtualHid();
+    ~VirtualHid();
+    static bool isSupported();
+    /* vendor defined collection with input, output and feature reports of reportSize bytes */
+    static std::vector<unsigned char> vendorDescriptor(unsigned short usagePage, unsigned short usage,
+                                                      std::size_t reportSize = default_report_size);
+    int create(const std::string &name, unsigned short vid, unsigned short pid,
+               const std::vector<unsigned char> &descriptor,
+               std::size_t reportSize_ = default_report_size);
+    void destroy();
+    /* one input report, the payload is padded or cut to the report size */
+    int input(const unsigned char *data, std::size_t size);
+    /* stream stamped reports at rate per second once the host has opened the device */
+    int startReports(unsigned int rate_);
+    void stopReports();
+    /* hook for Hid::registerProcess on the receiving side */
+    void check(const unsigned char *data, std::size_t size);
+    /* microseconds since the report was stamped, negative when it carries no stamp */
+    static double latency(const unsigned char *data, std::size_t size);
+    Stats getStats();
+    void resetStats();
+};
+
+#endif // VIRTUALHID_H
@@ -0,0 +1,147 @@
+#include "warmup.h"
+
+void Warmup::run(std::size_t index)
+{
+    int ret = tasks[index]();
+    std::vector<int> done;
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        results[index] = ret;
+        remaining--;
+        if (remaining > 0) {
+            return;
+        }
+        done = results;
+        condit.notify_all();
+    }
+    ready(done);
+    return;
+}
+
+Warmup::Warmup():
+    remaining(0),
+    isStarted(false),
+    needUsb(false),
+    needHid(false)
+{
+    ready = [](const std::vector<int>&){};
+}
+
+Warmup::~Warmup()
+{
+    for (std::size_t i = 0; i < threads.size(); i++) {
+        if (threads[i].joinable()) {
+            threads[i].join();
+        }
+    }
+}
+
+void Warmup::add(const Warmup::FnTask &task)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (isStarted) {
+        return;
+    }
+    tasks.push_back(task);
+    return;
+}
+
+void Warmup::add(Usb &usb, unsigned short vendorID, unsigned short productID)
+{
+    needUsb = true;
+    add([&usb, vendorID, productID]()->int {
+        return usb.openDevice(vendorID, productID);
+    });
+    return;
+}
+
+void Warmup::add(UsbAsync &usb, unsigned short vendorID, unsigned short productID)
+{
+    needUsb = true;
+    /* start also spins up the event thread and allocates the read ring */
+    add([&usb, vendorID, productID]()->int {
+        return usb.start(vendorID, productID);
+    });
+    return;
+}
+
+void Warmup::add(Hid &hid, unsigned short vendorID, unsigned short productID)
+{
+    needHid = true;
+    add([&hid, vendorID, productID]()->int {
+        return hid.start(vendorID, productID);
+    });
+    return;
+}
+
+void Warmup::add(Hid &hid, unsigned short vendorID, unsigned short productID,
+                 unsigned short usagePage, unsigned short usage)
+{
+    needHid = true;
+    add([&hid, vendorID, productID, usagePage, usage]()->int {
+        return hid.start(vendorID, productID, usagePage, usage);
+    });
+    return;
+}
+
+int Warmup::start()
+{
+    {
+        std::unique_lock<std::mutex> locker(mutex);
+        if (isStarted || tasks.empty()) {
+            return WARMUP_INVALID_PARAM;
+        }
+        isStarted = true;
+        remaining = tasks.size();
+        results.assign(tasks.size(), WARMUP_FAILED);
+    }
+    /* both libraries come up side by side, sessions wait for them on first use */
+    if (needUsb) {
+        threads.push_back(std::thread([]() {
+            Usb::getContext();
+        }));
+    }
+    if (needHid) {
+        threads.push_back(std::thread([]() {
+            Hid::initialize();
+        }));
+    }
+    for (std::size_t i = 0; i < tasks.size(); i++) {
+        threads.push_back(std::thread(&Warmup::run, this, i));
+    }
+    return WARMUP_SUCCESS;
+}
+
+int Warmup::wait(int timeout)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    if (!isStarted) {
+        return WARMUP_INVALID_PARAM;
+    }
+    auto done = [this]()->bool {
+        return remaining == 0;
+    };
+    if (timeout < 0) {
+        condit.wait(locker, done);
+    } else if (!condit.wait_for(locker, std::chrono::milliseconds(timeout), done)) {
+        return WARMUP_TIMEOUT;
+    }
+    for (std::size_t i = 0; i < results.size(); i++) {
+        if (results[i] != 0) {
+            return WARMUP_FAILED;
+        }
+    }
+    return WARMUP_SUCCESS;
+}
+
+bool Warmup::isReady()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return isStarted && remaining == 0;
+}
+
+std::vector<int> Warmup::getResults()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return results;
+}
@@ -0,0 +1,57 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "usbasync.h"
+#include "hid.h"
+
+/* brings device sessions up in parallel at process start: library init,
+   enumeration, open, claim and the read ring of every session run side by
+   side, readiness is signalled once each of them has opened or failed */
+class Warmup
+{
+public:
+    enum Code {
+        WARMUP_SUCCESS = 0,
+        WARMUP_INVALID_PARAM,
+        WARMUP_TIMEOUT,
+        WARMUP_FAILED
+    };
+    /* returns 0 once its session is usable */
+    using FnTask = std::function<int(void)>;
+    using FnReady = std::function<void(const std::vector<int>&)>;
+protected:
+    std::vector<FnTask> tasks;
+    std::vector<int> results;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable condit;
+    std::size_t remaining;
+    bool isStarted;
+    bool needUsb;
+    bool needHid;
+    FnReady ready;
+protected:
+    void run(std::size_t index);
+public:
+    Warmup();
+    ~Warmup();
+    void add(const FnTask &task);
+    void add(Usb &usb, unsigned short vendorID, unsigned short productID);
+    void add(UsbAsync &usb, unsigned short vendorID, unsigned short productID);
+    void add(Hid &hid, unsigned short vendorID, unsigned short productID);
+    void add(Hid &hid, unsigned short vendorID, unsigned short productID,
+             unsigned short usagePage, unsigned short usage);
+    /* runs on the thread of the last session to finish */
+    void registerReady(const FnReady &func) {ready = func;}
+    int start();
+    /* timeout in ms, -1 waits forever */
+    int wait(int timeout = -1);
+    bool isReady();
+    std::vector<int> getResults();
+};
+
+#endif // WARMUP_H